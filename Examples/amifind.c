@@ -122,7 +122,7 @@ void search(const char *dir, const char *pattern, const char *flagstr)
         printf("could not obtain lock for directory %s\n", dir);
         goto ENOLOCK;
     }
-    if ((fib = AllocVec(sizeof(struct FileInfoBlock), MEMF_CLEAR)) == NULL) {
+    if ((fib = AllocDosObject(DOS_FIB, NULL)) == NULL) {
         printf("could not allocate memory for FileInfoBlock\n");
         goto ENOMEM;
     }
@@ -165,7 +165,7 @@ void search(const char *dir, const char *pattern, const char *flagstr)
         
 ENODIR:
 ENOEXAM:
-    FreeVec(fib);
+    FreeDosObject(DOS_FIB, fib);
 ENOMEM:
     UnLock(lock);
 ENOLOCK:
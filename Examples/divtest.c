@@ -0,0 +1,62 @@
+//
+// divtest.c - test program for the 32-bit division of libgcc (the loops of klibc or utility.library with
+// "make UTILITY_DIV=1")
+//
+
+
+#include <proto/dos.h>
+
+
+typedef struct
+{
+    long num, den, quot, rem;
+} SIGNED_CASE;
+
+typedef struct
+{
+    unsigned long num, den, quot, rem;
+} UNSIGNED_CASE;
+
+// the quotient is truncated towards zero and the remainder has the sign of the dividend
+static const SIGNED_CASE signedCases[] = {
+    {100, 7, 14, 2},
+    {-100, 7, -14, -2},
+    {100, -7, -14, 2},
+    {-100, -7, 14, -2},
+    {7, 100, 0, 7},
+    {0x7fffffff, 1000, 2147483, 647},
+    {-0x7fffffff - 1, 3, -715827882, -2}
+};
+
+static const UNSIGNED_CASE unsignedCases[] = {
+    {100, 7, 14, 2},
+    {0xffffffff, 7, 613566756, 3},
+    {0x80000000, 3, 715827882, 2},
+    {0xfffffffe, 0xffffffff, 0, 0xfffffffe},
+    {123456789, 1, 123456789, 0}
+};
+
+
+int cwmain()
+{
+    // volatile, so GCC doesn't compute the results at compile time
+    volatile long sn, sd;
+    volatile unsigned long un, ud;
+    int i, errors = 0;
+
+    for (i = 0; i < sizeof(signedCases) / sizeof(signedCases[0]); i++) {
+        sn = signedCases[i].num;
+        sd = signedCases[i].den;
+        if ((sn / sd != signedCases[i].quot) || (sn % sd != signedCases[i].rem))
+            errors++;
+    }
+    for (i = 0; i < sizeof(unsignedCases) / sizeof(unsignedCases[0]); i++) {
+        un = unsignedCases[i].num;
+        ud = unsignedCases[i].den;
+        if ((un / ud != unsignedCases[i].quot) || (un % ud != unsignedCases[i].rem))
+            errors++;
+    }
+    PutStr(errors ? "divisions computed wrongly\n" : "divisions computed correctly\n");
+
+    return errors != 0;
+}
@@ -0,0 +1,78 @@
+//
+// flagtest.c - test program for the comparisons dropped by the block cache because their flags are never read (and for
+// one that must not be dropped)
+//
+
+
+#include <proto/dos.h>
+
+
+#define NUM_LOOPS 2000                      // enough to make the blocks hot
+
+
+// The flags of the CMPI and the CMP are overwritten by the MOVEQ, so both are dead. Their immediate data is
+// 0x74ff74ff, which is MOVEQ #-1,D2 twice if it is executed as code, so the result is 0 instead of 1 if the block
+// cache gets the PC wrong when skipping one of them.
+static int deadCompares(int x)
+{
+    register int d0 __asm("d0") = x;
+    register int d2 __asm("d2");
+    __asm volatile ("moveq   #0,d2\n\t"
+                    "cmpi.l  #0x74ff74ff,d0\n\t"
+                    "cmp.w   #0x74ff,d0\n\t"
+                    "moveq   #1,d1\n\t"
+                    "add.l   d1,d2"
+                    : "=r" (d2) : "r" (d0) : "d1", "cc");
+    return d2;
+}
+
+
+// same for a TST with a displacement (0x74ff is again MOVEQ #-1,D2)
+static int deadTest(char *p)
+{
+    register char *a0 __asm("a0") = p - 0x74ff;
+    register int d2 __asm("d2");
+    __asm volatile ("moveq   #0,d2\n\t"
+                    "tst.b   0x74ff(a0)\n\t"
+                    "moveq   #1,d1\n\t"
+                    "add.l   d1,d2"
+                    : "=r" (d2) : "r" (a0) : "d1", "cc");
+    return d2;
+}
+
+
+// CHK within its bounds doesn't change N (in the interpreter), so the TST in front of it is not dead. The result is 1
+// if N from the TST survives the CHK and 0 if the block cache drops the TST.
+static int liveTestBeforeCheck(int x)
+{
+    register int d0 __asm("d0") = x;
+    register int d2 __asm("d2");
+    __asm volatile ("moveq   #0,d2\n\t"
+                    "moveq   #10,d1\n\t"
+                    "moveq   #5,d4\n\t"
+                    "tst.l   d0\n\t"
+                    "chk.w   d1,d4\n\t"
+                    "smi     d2\n\t"
+                    "neg.b   d2"
+                    : "=r" (d2) : "r" (d0) : "d1", "d4", "cc");
+    return d2;
+}
+
+
+int cwmain()
+{
+    char c = 0;
+    int i, errors = 0;
+
+    for (i = 0; i < NUM_LOOPS; i++) {
+        if (deadCompares(i) != 1)
+            errors++;
+        if (deadTest(&c) != 1)
+            errors++;
+        if (liveTestBeforeCheck(-1 - i) != 1)
+            errors++;
+    }
+    PutStr(errors ? "dead comparisons executed wrongly\n" : "dead comparisons executed correctly\n");
+
+    return errors != 0;
+}
@@ -0,0 +1,61 @@
+//
+// fpbench.c - floating point benchmark, compare "time vadm Examples/fpbench" (software floating point of libgcc)
+// with "time vadm Examples/fpbench-lib" (the same calculation done by calling mathieeedoubbas.library)
+//
+
+
+#include <stdio.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+
+
+#define NUM_STEPS 200000
+
+
+#ifdef USE_MATHLIB
+#include <proto/mathieeedoubbas.h>
+
+// see comment in cwcrt0.c why this is an array
+static char libname[] = "mathieeedoubbas.library";
+struct Library *MathIeeeDoubBasBase;
+
+#define FLT(i)    IEEEDPFlt(i)
+#define FIX(x)    IEEEDPFix(x)
+#define ADD(x, y) IEEEDPAdd(x, y)
+#define MUL(x, y) IEEEDPMul(x, y)
+#define DIV(x, y) IEEEDPDiv(x, y)
+#else
+#define FLT(i)    ((double) (i))
+#define FIX(x)    ((int) (x))
+#define ADD(x, y) ((x) + (y))
+#define MUL(x, y) ((x) * (y))
+#define DIV(x, y) ((x) / (y))
+#endif
+
+
+int cwmain()
+{
+    int i;
+    double h, x, sum = 0.0, pi;
+
+#ifdef USE_MATHLIB
+    if ((MathIeeeDoubBasBase = OpenLibrary(libname, 0L)) == NULL) {
+        PutStr("could not open mathieeedoubbas.library\n");
+        return 1;
+    }
+#endif
+
+    // integrate 4 / (1 + x^2) from 0 to 1 with the midpoint rule
+    h = DIV(1.0, FLT(NUM_STEPS));
+    for (i = 0; i < NUM_STEPS; i++) {
+        x   = MUL(ADD(FLT(i), 0.5), h);
+        sum = ADD(sum, DIV(4.0, ADD(1.0, MUL(x, x))));
+    }
+    pi = MUL(sum, h);
+    printf("pi = %d.%06d\n", FIX(pi), FIX(MUL(ADD(pi, FLT(-FIX(pi))), 1000000.0)));
+
+#ifdef USE_MATHLIB
+    CloseLibrary(MathIeeeDoubBasBase);
+#endif
+    return 0;
+}
@@ -0,0 +1,22 @@
+//
+// libcallbench.c - microbenchmark for the library calls (run it with "time vadm Examples/libcallbench")
+//
+
+
+#include <proto/dos.h>
+
+
+#define NUM_CALLS 1000000
+
+
+int cwmain()
+{
+    int i;
+
+    // IoErr() does nothing but return a value, so this measures just the round-trip of a library call
+    for (i = 0; i < NUM_CALLS; i++)
+        IoErr();
+    PutStr("done\n");
+
+    return 0;
+}
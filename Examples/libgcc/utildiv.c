@@ -0,0 +1,98 @@
+//
+// utildiv.c - 32-bit division of libgcc done by UDivMod32() / SDivMod32() of utility.library instead of a loop of
+// 68k instructions (used instead of __divsi3.c, __modsi3.c and __udivmodsi4.c of klibc with "make UTILITY_DIV=1")
+//
+
+
+#include <stdint.h>
+#include <proto/exec.h>
+#include "utility_lvo.h"                    // generated by genlvo.pl from utility_lib.fd
+
+
+#define STR(X)  #X
+#define XSTR(X) STR(X)
+
+
+// see comment in cwcrt0.c why this is an array
+static char libname[] = "utility.library";
+static struct Library *utilBase;
+
+
+static int openUtility(void)
+{
+    if (utilBase == NULL)
+        utilBase = OpenLibrary(libname, 37L);
+    return utilBase != NULL;
+}
+
+
+// The routines return the quotient in D0 and the remainder in D1, so we can't use the prototypes from the NDK.
+static uint32_t udivmod(uint32_t num, uint32_t den, uint32_t *rem)
+{
+    if (!openUtility())
+        return 0;
+
+    register uint32_t d0 __asm("d0") = num;
+    register uint32_t d1 __asm("d1") = den;
+    register struct Library *a6 __asm("a6") = utilBase;
+    __asm volatile ("jsr " XSTR(LVO_UDivMod32) "(a6)"
+                    : "+r" (d0), "+r" (d1) : "r" (a6) : "a0", "a1", "cc", "memory");
+    *rem = d1;
+    return d0;
+}
+
+
+static int32_t sdivmod(int32_t num, int32_t den, int32_t *rem)
+{
+    if (!openUtility())
+        return 0;
+
+    register int32_t d0 __asm("d0") = num;
+    register int32_t d1 __asm("d1") = den;
+    register struct Library *a6 __asm("a6") = utilBase;
+    __asm volatile ("jsr " XSTR(LVO_SDivMod32) "(a6)"
+                    : "+r" (d0), "+r" (d1) : "r" (a6) : "a0", "a1", "cc", "memory");
+    *rem = d1;
+    return d0;
+}
+
+
+uint32_t __udivmodsi4(uint32_t num, uint32_t den, uint32_t *rem_p)
+{
+    uint32_t rem;
+    uint32_t quot = udivmod(num, den, &rem);
+
+    if (rem_p)
+        *rem_p = rem;
+    return quot;
+}
+
+
+uint32_t __udivsi3(uint32_t num, uint32_t den)
+{
+    uint32_t rem;
+    return udivmod(num, den, &rem);
+}
+
+
+uint32_t __umodsi3(uint32_t num, uint32_t den)
+{
+    uint32_t rem;
+    udivmod(num, den, &rem);
+    return rem;
+}
+
+
+int32_t __divsi3(int32_t num, int32_t den)
+{
+    int32_t rem;
+    return sdivmod(num, den, &rem);
+}
+
+
+int32_t __modsi3(int32_t num, int32_t den)
+{
+    int32_t rem;
+    sdivmod(num, den, &rem);
+    return rem;
+}
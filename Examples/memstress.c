@@ -0,0 +1,57 @@
+//
+// memstress.c - stress test for the memory manager (run it with "time vadm Examples/memstress [number of blocks]")
+//
+// Allocates many small blocks, frees every second one and allocates blocks of other sizes into the holes, several
+// rounds in a row. With an allocator that searches all blocks on each allocation the run time grows with the square
+// of the number of blocks, so compare the times for e.g. 750, 3000 and 12000 blocks.
+//
+
+
+#include <stdio.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+
+
+#define MAX_BLOCKS 12000               // the blocks are at most 224 bytes, so they all fit into the 4MB heap
+#define NUM_ROUNDS 10
+
+
+static void *blocks[MAX_BLOCKS];
+
+
+int cwmain(int argc, char **argv)
+{
+    int nblocks = 3000, i, round;
+    const char *p;
+
+    if (argc > 1) {
+        for (nblocks = 0, p = argv[1]; (*p >= '0') && (*p <= '9'); p++)
+            nblocks = nblocks * 10 + *p - '0';
+        if ((nblocks <= 0) || (nblocks > MAX_BLOCKS)) {
+            printf("number of blocks must be between 1 and %d\n", MAX_BLOCKS);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        if ((blocks[i] = AllocVec(16 + i % 64, 0)) == NULL) {
+            printf("out of memory after %d blocks\n", i);
+            return 1;
+        }
+    }
+    for (round = 0; round < NUM_ROUNDS; round++) {
+        for (i = round % 2; i < nblocks; i += 2)
+            FreeVec(blocks[i]);
+        for (i = round % 2; i < nblocks; i += 2) {
+            if ((blocks[i] = AllocVec(16 + (i + round) % 200, 0)) == NULL) {
+                printf("out of memory in round %d\n", round);
+                return 1;
+            }
+        }
+    }
+    for (i = 0; i < nblocks; i++)
+        FreeVec(blocks[i]);
+    printf("%d blocks, %d rounds done\n", nblocks, NUM_ROUNDS);
+
+    return 0;
+}
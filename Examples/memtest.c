@@ -9,14 +9,14 @@
 
 int cwmain()
 {
-    void *ptr1, *ptr2;
+    char *ptr1, *ptr2;
 
-    // allocate a block than can hold 2 x 256 bytes and the MCB for the second block
-    PutStr("allocating 520 bytes\n");
-    ptr1 = AllocVec(520, 0);
+    // allocate a block that can hold 2 x 256 bytes
+    PutStr("allocating 512 bytes\n");
+    ptr1 = AllocVec(512, 0);
     FreeVec(ptr1);
 
-    // check if size is rounded up to 256 and previous block is split
+    // check if size is rounded up to 16 and the previous block (which went back to the top of the heap) is split
     PutStr("allocating 100 bytes\n");
     ptr1 = AllocVec(100, 0);
     FreeVec(ptr1);
@@ -26,6 +26,12 @@ int cwmain()
     ptr1 = AllocVec(256, 0);
     ptr2 = AllocVec(256, 0);
     FreeVec(ptr2);
+
+    // invalid frees are detected by the memory manager and ignored (they are logged as errors)
+    PutStr("freeing invalid blocks\n");
+    FreeVec(ptr1 + 16);
+    FreeVec(ptr2);
+    FreeVec(NULL);
     FreeVec(ptr1);
 
     return 0;
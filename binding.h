@@ -0,0 +1,298 @@
+//
+// VADM - typed binding of the library routines to their arguments in the registers of the CPU
+//
+// A library routine is implemented as a method whose parameters say in which register each argument is passed
+// and how it is converted, for example
+//
+//     BcplAddr Lock(GuestStr<D1> path, U32<D2> mode);
+//
+// BIND(DOSLibrary, Lock) then generates a thunk which fetches the registers, converts the arguments, calls the
+// method and puts the result into D0. The thunks are plain functions, so the dispatcher needs neither casts of
+// member function pointers nor any lookups.
+//
+// Copyright(C) 2017 Constantin Wiemer
+//
+
+
+#ifndef VADM_BINDING_H
+#define VADM_BINDING_H
+
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include "memory.h"
+
+extern "C"
+{
+#include "Musashi/m68k.h"
+}
+
+
+class AmiLibrary;
+
+
+// registers used for passing arguments
+enum GuestRegister
+{
+    D0 = M68K_REG_D0, D1 = M68K_REG_D1, D2 = M68K_REG_D2, D3 = M68K_REG_D3,
+    D4 = M68K_REG_D4, D5 = M68K_REG_D5, D6 = M68K_REG_D6, D7 = M68K_REG_D7,
+    A0 = M68K_REG_A0, A1 = M68K_REG_A1, A2 = M68K_REG_A2, A3 = M68K_REG_A3,
+    A4 = M68K_REG_A4, A5 = M68K_REG_A5, A6 = M68K_REG_A6
+};
+
+
+//
+// types of arguments
+//
+
+// unsigned 32-bit value
+template <GuestRegister R>
+struct U32
+{
+    static const GuestRegister REG = R;
+    uint32_t value;
+    static U32 fetch() { return {(uint32_t) m68k_get_reg(NULL, (m68k_register_t) R)}; }
+    operator uint32_t() const { return value; }
+};
+
+// signed 32-bit value
+template <GuestRegister R>
+struct I32
+{
+    static const GuestRegister REG = R;
+    int32_t value;
+    static I32 fetch() { return {(int32_t) m68k_get_reg(NULL, (m68k_register_t) R)}; }
+    operator int32_t() const { return value; }
+};
+
+// pointer to guest memory (as address in guest memory)
+template <GuestRegister R>
+struct GuestPtr
+{
+    static const GuestRegister REG = R;
+    uint32_t addr;
+    static GuestPtr fetch() { return {(uint32_t) m68k_get_reg(NULL, (m68k_register_t) R)}; }
+    operator uint32_t() const { return addr; }
+};
+
+// BCPL pointer (converted to an address in guest memory)
+template <GuestRegister R>
+struct BcplPtr
+{
+    static const GuestRegister REG = R;
+    uint32_t addr;
+    static BcplPtr fetch() { return {PTR_BCPL_TO_C(m68k_get_reg(NULL, (m68k_register_t) R))}; }
+    operator uint32_t() const { return addr; }
+};
+
+// NUL-terminated string in guest memory (copied)
+template <GuestRegister R>
+struct GuestStr
+{
+    static const GuestRegister REG = R;
+    std::string str;
+    static GuestStr fetch() { return {readGuestString(m68k_get_reg(NULL, (m68k_register_t) R))}; }
+    operator const std::string &() const { return str; }
+};
+
+// IEEE double precision number in a pair of registers (high longword first)
+template <GuestRegister HI, GuestRegister LO>
+struct Double
+{
+    static const GuestRegister REG = HI;
+    double value;
+    static Double fetch()
+    {
+        const uint64_t bits = ((uint64_t) m68k_get_reg(NULL, (m68k_register_t) HI) << 32) |
+                              m68k_get_reg(NULL, (m68k_register_t) LO);
+        Double arg;
+        memcpy(&arg.value, &bits, sizeof(arg.value));
+        return arg;
+    }
+    operator double() const { return value; }
+};
+
+// conversion between the Motorola fast floating point format (24-bit mantissa with the MSB set, sign, 7-bit exponent
+// in excess-64 notation, 0 is represented by all bits being 0) and host floats, which can represent all FFP numbers
+inline float ffpToFloat(const uint32_t ffp)
+{
+    if ((ffp & 0xffffff00) == 0)
+        return 0.0f;
+    const float value = ldexpf((float) (ffp >> 8), (int) (ffp & 0x7f) - 64 - 24);
+    return (ffp & 0x80) ? -value : value;
+}
+
+inline uint32_t floatToFfp(const float value)
+{
+    int exp;
+    const float mant = frexpf(fabsf(value), &exp);
+    if ((value == 0.0f) || (exp + 64 < 0))
+        return 0;                                   // zero or underflow
+    const uint32_t sign = signbit(value) ? 0x80 : 0;
+    if (!isfinite(value) || (exp + 64 > 127))
+        return 0xffffff7f | sign;                   // overflow => largest number
+    return ((uint32_t) ldexpf(mant, 24) << 8) | sign | (exp + 64);
+}
+
+// number in fast floating point format
+template <GuestRegister R>
+struct Ffp
+{
+    static const GuestRegister REG = R;
+    float value;
+    static Ffp fetch() { return {ffpToFloat(m68k_get_reg(NULL, (m68k_register_t) R))}; }
+    operator float() const { return value; }
+};
+
+
+// registers used by an argument (only doubles need two registers)
+template <typename ARG>
+struct ArgRegs
+{
+    static const uint8_t first = ARG::REG, second = 0xff;
+};
+
+template <GuestRegister HI, GuestRegister LO>
+struct ArgRegs<Double<HI, LO>>
+{
+    static const uint8_t first = HI, second = LO;
+};
+
+
+//
+// types of results (always returned in D0)
+//
+
+// address in guest memory that is returned to the program as BCPL pointer
+struct BcplAddr
+{
+    uint32_t addr;
+};
+
+inline void setResult(const uint32_t value)
+{
+    m68k_set_reg(M68K_REG_D0, value);
+}
+
+inline void setResult(const int32_t value)
+{
+    m68k_set_reg(M68K_REG_D0, (uint32_t) value);
+}
+
+inline void setResult(const BcplAddr result)
+{
+    m68k_set_reg(M68K_REG_D0, PTR_C_TO_BCPL(result.addr));
+}
+
+// two values that are returned in D0 and D1 (like quotient and remainder or a 64-bit product)
+struct RegPair
+{
+    uint32_t d0;
+    uint32_t d1;
+};
+
+inline void setResult(const RegPair result)
+{
+    m68k_set_reg(M68K_REG_D0, result.d0);
+    m68k_set_reg(M68K_REG_D1, result.d1);
+}
+
+// IEEE double precision number that is returned in D0 / D1
+struct DoubleVal
+{
+    double value;
+};
+
+inline void setResult(const DoubleVal result)
+{
+    uint64_t bits;
+    memcpy(&bits, &result.value, sizeof(bits));
+    m68k_set_reg(M68K_REG_D0, (uint32_t) (bits >> 32));
+    m68k_set_reg(M68K_REG_D1, (uint32_t) bits);
+}
+
+// number that is returned in fast floating point format
+struct FfpVal
+{
+    float value;
+};
+
+inline void setResult(const FfpVal result)
+{
+    m68k_set_reg(M68K_REG_D0, floatToFfp(result.value));
+}
+
+
+//
+// thunks
+//
+
+// thunk called by the dispatcher (AmiLibrary::call())
+typedef void (*THUNK)(AmiLibrary *lib);
+
+// implementation of a library routine, bound to the routine in the table generated from the .fd files by its name
+typedef struct
+{
+    const char *fb_name;
+    THUNK      fb_thunk;
+    size_t     (*fb_getRegs)(const uint8_t **regs);     // registers of the arguments (for checking the binding)
+} FUNC_BINDING;
+
+
+// registers of all arguments of a routine in the order in which they appear in the .fd file
+template <typename... ARGS>
+size_t collectRegs(const uint8_t **regs)
+{
+    static const uint8_t pairs[][2] = {{ArgRegs<ARGS>::first, ArgRegs<ARGS>::second}..., {0xff, 0xff}};
+    static uint8_t r[2 * sizeof...(ARGS) + 1];
+    size_t n = 0;
+    for (size_t i = 0; i < sizeof...(ARGS); ++i) {
+        for (size_t j = 0; (j < 2) && (pairs[i][j] != 0xff); ++j)
+            r[n++] = pairs[i][j];
+    }
+    r[n] = 0xff;
+    *regs = r;
+    return n;
+}
+
+
+template <typename F, F FUNC>
+struct Thunk;
+
+template <typename C, typename R, typename... ARGS, R (C::*FUNC)(ARGS...)>
+struct Thunk<R (C::*)(ARGS...), FUNC>
+{
+    static void call(AmiLibrary *lib)
+    {
+        setResult((static_cast<C *>(lib)->*FUNC)(ARGS::fetch()...));
+    }
+
+    static size_t getRegs(const uint8_t **regs)
+    {
+        return collectRegs<ARGS...>(regs);
+    }
+};
+
+// routines without a result don't touch D0
+template <typename C, typename... ARGS, void (C::*FUNC)(ARGS...)>
+struct Thunk<void (C::*)(ARGS...), FUNC>
+{
+    static void call(AmiLibrary *lib)
+    {
+        (static_cast<C *>(lib)->*FUNC)(ARGS::fetch()...);
+    }
+
+    static size_t getRegs(const uint8_t **regs)
+    {
+        return collectRegs<ARGS...>(regs);
+    }
+};
+
+
+#define BIND(CLASS, NAME) \
+    {#NAME, &Thunk<decltype(&CLASS::NAME), &CLASS::NAME>::call, &Thunk<decltype(&CLASS::NAME), &CLASS::NAME>::getRegs}
+
+
+#endif //VADM_BINDING_H
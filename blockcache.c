@@ -0,0 +1,983 @@
+//
+// VADM - cache of predecoded basic blocks for the CPU emulation
+//
+// Musashi fetches and decodes every instruction through its jump table each time it is executed. The functions here
+// replace m68k_execute() with a loop that decodes a basic block (a sequence of instructions ending with a branch,
+// jump, return or trap) once, stores the handler and the number of cycles for each of its instructions and then just
+// calls the handlers when the block is executed again. The handlers themselves still fetch their extension words
+// from memory, so only the opcode words need to stay unchanged. Writes to the code area are reported by the memory
+// handlers through m68k_invalidate_blocks(), which drops all blocks that contain the written address.
+//
+// The execution count of each block is recorded. Blocks which have been executed more than BLOCK_HOT_THRESHOLD
+// times are hot and remember the blocks executed after them (one for falling through, one for a branch), so the
+// lookup in the hash table is skipped for them. In verify mode the opcodes of a hot block are compared with the
+// memory each time before it is executed, which catches writes to the code that were not reported to the cache.
+// Then the block is cross-checked (see crossCheckBlock()): it is executed once from the cache and, after the registers
+// and the memory have been restored, once more by the interpreter, and the results must be the same.
+//
+// When a block is decoded, a few common sequences are fused (see fuseBlock()): a TST of a data register right after
+// a MOVE to the same register is dropped because the MOVE already has set the flags exactly like the TST would. A block
+// ending with MOVE.L (An)+,Dn / Bcc.S (with or without a TST.L Dn in between), the typical loop over a list or an
+// array of pointers, gets one handler for the whole sequence (see moveTestBranch()). A block that branches back to
+// its own start (a DBcc loop) is executed again without going through the dispatcher. Which sequences are worth
+// fusing can be found out with the statistics of opcode pairs (m68k_set_opcode_pair_stats()).
+//
+// Musashi already keeps the flags in a deferred form (for example FLAG_Z holds the result and FLAG_N its sign bit),
+// so the flags are cheap to set and are only assembled into the CCR by m68ki_get_sr() when it is needed. What we can
+// still save are the comparisons and tests whose flags are never looked at: if a TST or CMP is followed in the same
+// block by an instruction that sets all of N, Z, V and C before any instruction reads them, the TST / CMP is dropped
+// (see dropDeadFlags()). Only instructions without extension words are dropped because the PC is advanced just by
+// the opcode word for them. Flags are considered live at the end of a block and at every instruction we don't know,
+// which includes TRAP and the line A opcodes used for library calls, so the flags are always exact when a library
+// routine or an exception handler looks at them. Other exceptions stack the SR as well, but they are fatal for the
+// program in VADM anyway.
+//
+// Blocks consisting of nothing but one of the loops that copy, clear or scan memory element by element, for example
+//
+//     loop:   move.b  (a0)+,(a1)+             loop:   clr.l   (a0)+           loop:   tst.b   (a0)+
+//             dbf     d0,loop                         dbf     d0,loop                 bne.s   loop
+//
+// are recognized when they are decoded (see detectIdiom()). When the program enters such a loop at its head, all
+// its iterations are executed by one bulk operation of the memory manager, and the registers and flags are set as
+// if the loop had run (see runIdiom()). If the memory involved isn't plain RAM, the operands are misaligned or the
+// areas of a copy overlap in a way that the loop wouldn't behave like a memmove(), the loop is executed normally.
+//
+// Copyright(C) 2017 Constantin Wiemer
+//
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Musashi/m68kcpu.h"
+#include "Musashi/m68kops.h"
+#include "blockcache.h"
+
+
+// The cache is divided into pages like the page table of the memory manager. Blocks never cross a page boundary,
+// so a write to a page only affects the blocks on that page.
+#define BLOCK_PAGE_SHIFT     12
+#define BLOCK_PAGE_SIZE      (1 << BLOCK_PAGE_SHIFT)
+#define BLOCK_NUM_PAGES      (0x01000000 >> BLOCK_PAGE_SHIFT)
+#define BLOCK_PAGE_INDEX(A)  (((A) >> BLOCK_PAGE_SHIFT) & (BLOCK_NUM_PAGES - 1))
+
+#define BLOCK_MAX_INSTRS     64
+#define BLOCK_HASH_SIZE      0x4000
+#define BLOCK_HASH(A)        (((A) >> 1) & (BLOCK_HASH_SIZE - 1))
+#define BLOCK_MAX_BLOCKS     0x10000        // the whole cache is flushed if it holds more blocks
+#define BLOCK_HOT_THRESHOLD  1000
+
+#define PAIR_TABLE_SIZE      0x10000        // must be a power of 2, the table is only filled up to 3/4
+#define PAIR_HASH(P)         (((P) * 0x9e3779b1) >> 16)
+
+// flags of decoded instructions
+#define DI_COMBINED          0x01           // handler executes all instructions up to the end of the block
+
+// loops that are executed as bulk operations
+#define IDIOM_NONE           0
+#define IDIOM_COPY           1              // MOVE (Am)+,(An)+ / DBF Dn
+#define IDIOM_FILL           2              // CLR (An)+ / DBF Dn
+#define IDIOM_SCAN           3              // TST.B (An)+ / BNE
+
+
+typedef struct
+{
+    void     (*di_handler)(void);           // handler from Musashi's jump table
+    uint16_t di_opcode;
+    uint16_t di_cycles;
+    uint16_t di_flags;
+    uint32_t di_next;                       // address of the next instruction
+} DECODED_INSTR;
+
+typedef struct BLOCK
+{
+    uint32_t      blk_start;                // address of the first instruction
+    uint32_t      blk_end;                  // address behind the last instruction
+    int           blk_valid;
+    uint32_t      blk_ninstrs;
+    uint32_t      blk_execCount;
+    uint32_t      blk_epoch;                // value of s_epoch when the successors were recorded
+    int           blk_idiom;                // IDIOM_xxx if the block is a loop that can be executed as bulk operation
+    struct BLOCK  *blk_succ[2];             // successors of a hot block (fall through / branch taken)
+    struct BLOCK  *blk_hashNext;            // next block in the same hash bucket
+    struct BLOCK  *blk_pageNext;            // next block on the same page (or in the list of retired blocks)
+    DECODED_INSTR blk_instrs[];
+} BLOCK;
+
+typedef struct
+{
+    BLOCK   *cp_blocks;                     // blocks on this page
+    uint8_t cp_bitmap[BLOCK_PAGE_SIZE / 16]; // one bit for each word that is covered by a block
+} CODE_PAGE;
+
+typedef struct
+{
+    uint32_t op_pair;                       // first opcode in the upper, second opcode in the lower 16 bits
+    uint32_t op_address;                    // address of the first instruction when the pair was seen first
+    uint64_t op_count;
+} OPCODE_PAIR;
+
+
+void m68k_instr_callback(void);
+
+static uint32_t s_start, s_end;             // only code inside this area is cached
+static BLOCK *s_hashtab[BLOCK_HASH_SIZE];
+static CODE_PAGE *s_pages[BLOCK_NUM_PAGES];
+static BLOCK *s_retired;                    // invalidated blocks, freed when no block is executing
+static uint32_t s_nblocks;
+static uint32_t s_epoch;                    // incremented whenever a block is retired, invalidates all successor pointers
+static int s_verify;
+static int s_pairStats;
+static int s_loopIdioms;
+static uint32_t s_lastOpcode;               // opcode executed before, 0xffffffff if there is none
+static OPCODE_PAIR *s_pairs;
+static uint32_t s_npairs;
+static BLOCK_CACHE_STATS s_stats;
+
+
+//
+// initialize the cache for the code in the area start - end
+//
+void m68k_init_block_cache(uint32_t start, uint32_t end)
+{
+    s_start = start;
+    s_end   = end;
+}
+
+
+void m68k_set_block_cache_verify(int verify)
+{
+    s_verify = verify;
+}
+
+
+//
+// enable the execution of loop idioms as bulk operations
+//
+void m68k_set_loop_idioms(int enable)
+{
+    s_loopIdioms = enable;
+}
+
+
+//
+// enable the statistics of executed opcode pairs
+//
+void m68k_set_opcode_pair_stats(int enable)
+{
+    if (enable && (s_pairs == NULL))
+        s_pairs = (OPCODE_PAIR *) calloc(PAIR_TABLE_SIZE, sizeof(OPCODE_PAIR));
+    s_pairStats  = enable && (s_pairs != NULL);
+    s_lastOpcode = 0xffffffff;
+}
+
+
+static void countOpcodePair(uint16_t opcode, uint32_t address)
+{
+    uint32_t pair = (s_lastOpcode << 16) | opcode;
+    int first = s_lastOpcode == 0xffffffff;
+
+    s_lastOpcode = opcode;
+    if (first)
+        return;
+    for (uint32_t i = PAIR_HASH(pair); ; i = (i + 1) & (PAIR_TABLE_SIZE - 1)) {
+        if (s_pairs[i].op_count == 0) {
+            if (s_npairs >= PAIR_TABLE_SIZE / 4 * 3) {
+                ++s_stats.bcs_pairsDropped;
+                return;
+            }
+            s_pairs[i].op_pair    = pair;
+            s_pairs[i].op_address = address;
+            ++s_npairs;
+        }
+        else if (s_pairs[i].op_pair != pair)
+            continue;
+        ++s_pairs[i].op_count;
+        return;
+    }
+}
+
+
+//
+// fill info with (at most max) opcode pairs that have been executed most often, returns the number of pairs
+//
+int m68k_get_opcode_pairs(OPCODE_PAIR_INFO *info, int max)
+{
+    int n = 0;
+
+    if (s_pairs == NULL)
+        return 0;
+    for (uint32_t i = 0; i < PAIR_TABLE_SIZE; ++i) {
+        const OPCODE_PAIR *op = &s_pairs[i];
+        if (op->op_count == 0)
+            continue;
+        // insertion sort, the list is short
+        int pos = (n < max) ? n++ : max;
+        while ((pos > 0) && (info[pos - 1].opi_count < op->op_count)) {
+            if (pos < max)
+                info[pos] = info[pos - 1];
+            --pos;
+        }
+        if (pos < max) {
+            info[pos].opi_first   = op->op_pair >> 16;
+            info[pos].opi_second  = op->op_pair & 0xffff;
+            info[pos].opi_address = op->op_address;
+            info[pos].opi_count   = op->op_count;
+        }
+    }
+    return n;
+}
+
+
+void m68k_get_block_cache_stats(BLOCK_CACHE_STATS *stats)
+{
+    *stats = s_stats;
+}
+
+
+//
+// fill info with (at most max) blocks that have been executed most often, returns the number of blocks
+//
+int m68k_get_hot_blocks(HOT_BLOCK_INFO *info, int max)
+{
+    int n = 0;
+
+    for (uint32_t i = 0; i < BLOCK_HASH_SIZE; ++i) {
+        for (BLOCK *blk = s_hashtab[i]; blk; blk = blk->blk_hashNext) {
+            if (blk->blk_execCount < BLOCK_HOT_THRESHOLD)
+                continue;
+            // insertion sort, the list is short
+            int pos = (n < max) ? n++ : max;
+            while ((pos > 0) && (info[pos - 1].hbi_execCount < blk->blk_execCount)) {
+                if (pos < max)
+                    info[pos] = info[pos - 1];
+                --pos;
+            }
+            if (pos < max) {
+                info[pos].hbi_start     = blk->blk_start;
+                info[pos].hbi_end       = blk->blk_end;
+                info[pos].hbi_ninstrs   = blk->blk_ninstrs;
+                info[pos].hbi_execCount = blk->blk_execCount;
+            }
+        }
+    }
+    return n;
+}
+
+
+// returns 1 if the instruction (always or usually) transfers control somewhere else
+static int endsBlock(uint16_t opcode)
+{
+    if ((opcode & 0xf000) == 0x6000)                // Bcc, BRA, BSR
+        return 1;
+    if ((opcode & 0xf0f8) == 0x50c8)                // DBcc
+        return 1;
+    if ((opcode & 0xff80) == 0x4e80)                // JSR, JMP
+        return 1;
+    if ((opcode & 0xfff0) == 0x4e40)                // TRAP
+        return 1;
+    if ((opcode & 0xfff8) == 0x4e70)                // RESET, NOP, STOP, RTE, RTD, RTS, TRAPV, RTR
+        return opcode != 0x4e71;
+    if ((opcode & 0xf1c0) == 0x4180)                // CHK
+        return 1;
+    if (opcode == 0x4afc)                           // ILLEGAL
+        return 1;
+    if (((opcode & 0xf000) == 0xa000) || ((opcode & 0xf000) == 0xf000))
+        return 1;                                   // line A / line F
+    return 0;
+}
+
+
+// mark the words covered by the block in the bitmap of its page (the extension words of the last instruction might
+// be on the next page, but they are fetched again each time the instruction is executed anyway)
+static void markBlock(CODE_PAGE *page, const BLOCK *blk)
+{
+    for (uint32_t addr = blk->blk_start; (addr < blk->blk_end) && (BLOCK_PAGE_INDEX(addr) == BLOCK_PAGE_INDEX(blk->blk_start)); addr += 2) {
+        uint32_t bit = (addr & (BLOCK_PAGE_SIZE - 1)) >> 1;
+        page->cp_bitmap[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+
+static void unlinkFromHash(BLOCK *blk)
+{
+    BLOCK **pp = &s_hashtab[BLOCK_HASH(blk->blk_start)];
+    while (*pp != blk)
+        pp = &(*pp)->blk_hashNext;
+    *pp = blk->blk_hashNext;
+}
+
+
+static void retireBlock(BLOCK *blk)
+{
+    blk->blk_valid = 0;
+    unlinkFromHash(blk);
+    ++s_epoch;
+    blk->blk_pageNext = s_retired;
+    s_retired = blk;
+    --s_nblocks;
+}
+
+
+static void freeRetiredBlocks(void)
+{
+    while (s_retired) {
+        BLOCK *blk = s_retired;
+        s_retired = blk->blk_pageNext;
+        free(blk);
+    }
+}
+
+
+static void flushCache(void)
+{
+    for (uint32_t i = 0; i < BLOCK_NUM_PAGES; ++i) {
+        CODE_PAGE *page = s_pages[i];
+        if (page == NULL)
+            continue;
+        while (page->cp_blocks) {
+            BLOCK *blk = page->cp_blocks;
+            page->cp_blocks = blk->blk_pageNext;
+            retireBlock(blk);
+            ++s_stats.bcs_blocksFlushed;
+        }
+        memset(page->cp_bitmap, 0, sizeof(page->cp_bitmap));
+    }
+}
+
+
+// drop all blocks on the page which contain an address in the range first - last
+static void invalidatePage(CODE_PAGE *page, uint32_t first, uint32_t last)
+{
+    uint32_t bit;
+    int hit = 0;
+
+    first &= ~1;
+    last  &= ~1;
+    for (uint32_t addr = first; addr <= last; addr += 2) {
+        bit = (addr & (BLOCK_PAGE_SIZE - 1)) >> 1;
+        if (page->cp_bitmap[bit >> 3] & (1 << (bit & 7))) {
+            hit = 1;
+            break;
+        }
+    }
+    if (!hit)
+        return;
+
+    BLOCK **pp = &page->cp_blocks;
+    while (*pp) {
+        BLOCK *blk = *pp;
+        if ((blk->blk_start <= last) && (blk->blk_end > first)) {
+            *pp = blk->blk_pageNext;
+            retireBlock(blk);
+            ++s_stats.bcs_blocksInvalidated;
+        }
+        else
+            pp = &blk->blk_pageNext;
+    }
+
+    // rebuild bitmap from the remaining blocks (blocks can overlap, so we can't just clear the bits of the dropped ones)
+    memset(page->cp_bitmap, 0, sizeof(page->cp_bitmap));
+    for (BLOCK *blk = page->cp_blocks; blk; blk = blk->blk_pageNext)
+        markBlock(page, blk);
+}
+
+
+//
+// drop all blocks which contain an address in the range address - address + size - 1 (called for all writes to
+// the code area, so the common case of a write to data has to be fast)
+//
+void m68k_invalidate_blocks(uint32_t address, uint32_t size)
+{
+    uint32_t last = address + size - 1;
+
+    if (size == 0)
+        return;
+    while (1) {
+        uint32_t pageEnd = address | (BLOCK_PAGE_SIZE - 1);
+        CODE_PAGE *page  = s_pages[BLOCK_PAGE_INDEX(address)];
+        if (page)
+            invalidatePage(page, address, (last < pageEnd) ? last : pageEnd);
+        if (last <= pageEnd)
+            break;
+        address = pageEnd + 1;
+    }
+}
+
+
+// returns 1 if the instruction calls VADM (library calls, intercepted functions) or stops the CPU, so a block ending
+// with it can't be executed twice for the cross-check
+static int callsOut(uint16_t opcode)
+{
+    if (((opcode & 0xf000) == 0xa000) || ((opcode & 0xf000) == 0xf000))
+        return 1;                                   // line A / line F
+    if ((opcode & 0xfff0) == 0x4e40)
+        return 1;                                   // TRAP
+    return (opcode == 0x4e70) || (opcode == 0x4e72) || (opcode == 0x4afc);      // RESET, STOP, ILLEGAL
+}
+
+
+// returns the number of the data register written by a MOVE / MOVEQ and the size of the operand (the size field
+// as used by TST), or -1 if the instruction is something else
+static int moveToDataReg(uint16_t opcode, int *size)
+{
+    static const int sizes[4] = {-1, 0, 2, 1};
+
+    if (((opcode & 0xc000) == 0) && ((opcode & 0x3000) != 0) && ((opcode & 0x01c0) == 0)) {
+        *size = sizes[(opcode >> 12) & 3];          // MOVE <ea>,Dn
+        return (opcode >> 9) & 7;
+    }
+    if ((opcode & 0xf100) == 0x7000) {
+        *size = 2;                                  // MOVEQ #<data>,Dn
+        return (opcode >> 9) & 7;
+    }
+    return -1;
+}
+
+
+// how an instruction deals with the flags N, Z, V and C
+#define FLAGS_NONE  0                               // doesn't touch them
+#define FLAGS_SET   1                               // sets all of them without reading them
+#define FLAGS_READ  2                               // reads them (or we don't know)
+
+static int flagUsage(uint16_t opcode)
+{
+    uint16_t size = (opcode >> 6) & 3, mode = (opcode >> 3) & 7;
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (((opcode & 0xff00) == 0x0c00) && (size != 3))
+            return FLAGS_SET;                       // CMPI
+        return FLAGS_READ;
+    case 0x1: case 0x2: case 0x3:
+        return (((opcode >> 6) & 7) == 1) ? FLAGS_NONE : FLAGS_SET;     // MOVEA / MOVE
+    case 0x4:
+        if (((opcode & 0xff00) == 0x4a00) && (size != 3))
+            return FLAGS_SET;                       // TST
+        if (((opcode & 0xff00) == 0x4200) && (size != 3))
+            return FLAGS_SET;                       // CLR
+        if (((opcode & 0xfff8) == 0x4840) || ((opcode & 0xffb8) == 0x4880))
+            return FLAGS_SET;                       // SWAP, EXT
+        if (((opcode & 0xffc0) == 0x4840) || ((opcode & 0xfb80) == 0x4880) || ((opcode & 0xf1c0) == 0x41c0) ||
+            ((opcode & 0xfff0) == 0x4e50) || (opcode == 0x4e71))
+            return FLAGS_NONE;                      // PEA, MOVEM, LEA, LINK / UNLK, NOP
+        return FLAGS_READ;
+    case 0x5:
+        if (size == 3)
+            return FLAGS_READ;                      // Scc, DBcc
+        return (mode == 1) ? FLAGS_NONE : FLAGS_SET;                    // ADDQ / SUBQ
+    case 0x7:
+        return ((opcode & 0x0100) == 0) ? FLAGS_SET : FLAGS_READ;       // MOVEQ
+    case 0x9: case 0xd:
+        if (size == 3)
+            return FLAGS_NONE;                      // ADDA, SUBA
+        if ((opcode & 0x0100) && (mode <= 1))
+            return FLAGS_READ;                      // ADDX, SUBX
+        return FLAGS_SET;                           // ADD, SUB
+    case 0xb:
+        return FLAGS_SET;                           // CMP, CMPA, CMPM, EOR
+    default:
+        return FLAGS_READ;
+    }
+}
+
+
+// returns 1 if the only effect of the instruction is setting the flags (TST and CMP without (An)+ or -(An), CMPI
+// isn't included because it always has an extension word)
+static int onlySetsFlags(uint16_t opcode)
+{
+    uint16_t mode = (opcode >> 3) & 7;
+
+    if ((mode == 3) || (mode == 4))
+        return 0;
+    if (((opcode & 0xff00) == 0x4a00) && (((opcode >> 6) & 3) != 3))
+        return 1;                                   // TST
+    if ((opcode & 0xf000) == 0xb000)
+        return ((opcode & 0x0100) == 0) || (((opcode >> 6) & 3) == 3);  // CMP, CMPA (not EOR / CMPM)
+    return 0;
+}
+
+
+// handler for instructions which have become redundant by fusing
+static void fusedNop(void)
+{
+}
+
+
+// Drop the TST / CMP instructions in a block starting at pc whose flags are overwritten before they are read. The
+// handler of a dropped instruction doesn't fetch its extension words, so instructions that have some are kept.
+static void dropDeadFlags(DECODED_INSTR *instrs, uint32_t ninstrs, uint32_t pc)
+{
+    int live = 1;                                   // flags are live at the end of the block
+
+    for (uint32_t i = ninstrs; i-- > 0; ) {
+        int usage = flagUsage(instrs[i].di_opcode);
+        uint32_t addr = (i > 0) ? instrs[i - 1].di_next : pc;
+        if (usage == FLAGS_SET) {
+            if (!live && onlySetsFlags(instrs[i].di_opcode) && (instrs[i].di_next - addr == 2)) {
+                instrs[i].di_handler = fusedNop;
+                ++s_stats.bcs_flagsDropped;
+            }
+            live = 0;
+        }
+        else if (usage == FLAGS_READ)
+            live = 1;
+    }
+}
+
+
+// Handler for MOVE.L (An)+,Dn / (TST.L Dn) / Bcc.S, called with REG_IR set to the MOVE and the PC pointing behind it.
+// The flags after the MOVE are the same as after the TST, so the TST is just skipped. The number of cycles of the
+// whole sequence is in the decoded instruction, we only correct it for a branch not taken like the handler of Bcc.
+static void moveTestBranch(void)
+{
+    uint32_t *an = &REG_A[REG_IR & 7];
+    uint32_t ea = *an;
+    *an += 4;
+    uint32_t res = m68ki_read_32(ea);
+    REG_D[(REG_IR >> 9) & 7] = res;
+    FLAG_N = NFLAG_32(res);
+    FLAG_Z = res;
+    FLAG_V = VFLAG_CLEAR;
+    FLAG_C = CFLAG_CLEAR;
+
+    uint32_t br = m68ki_read_imm_16();
+    if ((br & 0xf000) != 0x6000)
+        br = m68ki_read_imm_16();                   // the TST
+    REG_PPC = REG_PC - 2;
+    int taken;
+    switch ((br >> 8) & 0xf) {
+        case 0x2: taken = COND_HI(); break;
+        case 0x3: taken = COND_LS(); break;
+        case 0x4: taken = COND_CC(); break;
+        case 0x5: taken = COND_CS(); break;
+        case 0x6: taken = COND_NE(); break;
+        case 0x7: taken = COND_EQ(); break;
+        case 0x8: taken = COND_VC(); break;
+        case 0x9: taken = COND_VS(); break;
+        case 0xa: taken = COND_PL(); break;
+        case 0xb: taken = COND_MI(); break;
+        case 0xc: taken = COND_GE(); break;
+        case 0xd: taken = COND_LT(); break;
+        case 0xe: taken = COND_GT(); break;
+        default:  taken = COND_LE(); break;
+    }
+    if (taken)
+        m68ki_branch_8(MASK_OUT_ABOVE_8(br));
+    else
+        USE_CYCLES(CYC_BCC_NOTAKE_B);
+}
+
+
+// fuse common sequences of instructions in a block that has just been decoded
+static void fuseBlock(DECODED_INSTR *instrs, uint32_t ninstrs)
+{
+    int reg, size;
+
+    for (uint32_t i = 0; i + 1 < ninstrs; ++i) {
+        uint16_t op = instrs[i].di_opcode, next = instrs[i + 1].di_opcode;
+
+        // MOVE <ea>,Dn / TST Dn => TST is dropped (MOVE sets N and Z and clears V and C like TST does and both leave X alone)
+        if (((reg = moveToDataReg(op, &size)) >= 0) && (next == (0x4a00 | (size << 6) | reg)) &&
+            (instrs[i + 1].di_handler != fusedNop)) {
+            instrs[i + 1].di_handler = fusedNop;
+            ++s_stats.bcs_instrsDropped;
+        }
+    }
+
+    // MOVE.L (An)+,Dn / (TST.L Dn) / Bcc.S at the end of the block => one handler (not with the statistics of opcode
+    // pairs, which would miss the instructions executed by it)
+    if ((ninstrs < 2) || s_pairStats)
+        return;
+    uint16_t br = instrs[ninstrs - 1].di_opcode;
+    if (((br & 0xf000) != 0x6000) || ((br & 0x0f00) < 0x0200) || ((br & 0xff) == 0) || ((br & 0xff) == 0xff))
+        return;
+    uint32_t first = ninstrs - 2;
+    if ((first > 0) && (instrs[first].di_handler == fusedNop) && ((instrs[first].di_opcode & 0xfff8) == 0x4a80))
+        --first;
+    uint16_t op = instrs[first].di_opcode;
+    if (((op & 0xf1f8) != 0x2018) || ((first < ninstrs - 2) && (instrs[first + 1].di_opcode != (0x4a80 | ((op >> 9) & 7)))))
+        return;
+    instrs[first].di_handler = moveTestBranch;
+    instrs[first].di_flags  |= DI_COMBINED;
+    for (uint32_t i = first + 1; i < ninstrs; ++i)
+        instrs[first].di_cycles += instrs[i].di_cycles;
+    ++s_stats.bcs_sequencesCombined;
+}
+
+
+// returns the IDIOM_xxx of a block starting at pc that consists of the two instructions in instrs
+static int detectIdiom(const DECODED_INSTR *instrs, uint32_t ninstrs, uint32_t pc)
+{
+    if (ninstrs != 2)
+        return IDIOM_NONE;
+
+    uint16_t op = instrs[0].di_opcode, br = instrs[1].di_opcode;
+    uint32_t braddr = instrs[0].di_next;
+    if ((br & 0xfff8) == 0x51c8) {
+        // DBF Dn,<start>
+        if (braddr + 2 + (int16_t) m68k_peek_16(braddr + 2) != pc)
+            return IDIOM_NONE;
+        if (((op & 0xc1f8) == 0x00d8) && ((op & 0x3000) != 0)) {
+            // MOVE (Am)+,(An)+ with two different registers, neither of them SP (which is incremented by 2 for bytes)
+            uint16_t src = op & 7, dst = (op >> 9) & 7;
+            if ((src != dst) && (src != 7) && (dst != 7))
+                return IDIOM_COPY;
+        }
+        if (((op & 0xff38) == 0x4218) && ((op & 0x00c0) != 0x00c0) && ((op & 7) != 7))
+            return IDIOM_FILL;                      // CLR (An)+
+    }
+    else if ((br & 0xff00) == 0x6600) {
+        // BNE <start> (a displacement of 0xff is a long branch on later CPUs)
+        int32_t disp = (int8_t) (br & 0xff);
+        if ((br & 0xff) == 0)
+            disp = (int16_t) m68k_peek_16(braddr + 2);
+        else if ((br & 0xff) == 0xff)
+            return IDIOM_NONE;
+        if ((braddr + 2 + disp == pc) && ((op & 0xfff8) == 0x4a18) && ((op & 7) != 7))
+            return IDIOM_SCAN;                      // TST.B (An)+
+    }
+    return IDIOM_NONE;
+}
+
+
+//
+// decode the block starting at pc and add it to the cache
+//
+static BLOCK *decodeBlock(uint32_t pc)
+{
+    DECODED_INSTR instrs[BLOCK_MAX_INSTRS];
+    uint32_t ninstrs = 0;
+    uint32_t addr = pc;
+    char dasm[100];
+
+    if (s_nblocks >= BLOCK_MAX_BLOCKS)
+        flushCache();
+
+    do {
+        DECODED_INSTR *di = &instrs[ninstrs++];
+        di->di_opcode  = m68k_peek_16(addr);
+        di->di_handler = m68ki_instruction_jump_table[di->di_opcode];
+        di->di_cycles  = CYC_INSTRUCTION[di->di_opcode];
+        di->di_flags   = 0;
+        // The disassembler is the only part of Musashi that knows the length of an instruction.
+        addr += m68k_disassemble(dasm, addr, M68K_CPU_TYPE_68000);
+        di->di_next = addr;
+    } while (!endsBlock(instrs[ninstrs - 1].di_opcode) && (ninstrs < BLOCK_MAX_INSTRS) &&
+             (BLOCK_PAGE_INDEX(addr) == BLOCK_PAGE_INDEX(pc)) && (addr <= s_end));
+
+    dropDeadFlags(instrs, ninstrs, pc);
+    fuseBlock(instrs, ninstrs);
+
+    CODE_PAGE *page = s_pages[BLOCK_PAGE_INDEX(pc)];
+    if (page == NULL) {
+        if ((page = (CODE_PAGE *) calloc(1, sizeof(CODE_PAGE))) == NULL)
+            return NULL;
+        s_pages[BLOCK_PAGE_INDEX(pc)] = page;
+    }
+    BLOCK *blk = (BLOCK *) malloc(sizeof(BLOCK) + ninstrs * sizeof(DECODED_INSTR));
+    if (blk == NULL)
+        return NULL;
+    blk->blk_start   = pc;
+    blk->blk_end     = addr;
+    blk->blk_valid   = 1;
+    blk->blk_ninstrs = ninstrs;
+    blk->blk_execCount = 0;
+    blk->blk_epoch   = s_epoch;
+    blk->blk_idiom   = detectIdiom(instrs, ninstrs, pc);
+    blk->blk_succ[0] = blk->blk_succ[1] = NULL;
+    memcpy(blk->blk_instrs, instrs, ninstrs * sizeof(DECODED_INSTR));
+
+    blk->blk_hashNext = s_hashtab[BLOCK_HASH(pc)];
+    s_hashtab[BLOCK_HASH(pc)] = blk;
+    blk->blk_pageNext = page->cp_blocks;
+    page->cp_blocks = blk;
+    markBlock(page, blk);
+
+    ++s_nblocks;
+    ++s_stats.bcs_blocksDecoded;
+    return blk;
+}
+
+
+static BLOCK *lookupBlock(uint32_t pc)
+{
+    for (BLOCK *blk = s_hashtab[BLOCK_HASH(pc)]; blk; blk = blk->blk_hashNext) {
+        if (blk->blk_start == pc)
+            return blk;
+    }
+    return NULL;
+}
+
+
+// returns 0 if the opcodes of the block don't match the memory anymore
+static int verifyBlock(const BLOCK *blk)
+{
+    uint32_t addr = blk->blk_start;
+    for (uint32_t i = 0; i < blk->blk_ninstrs; ++i) {
+        if (m68k_peek_16(addr) != blk->blk_instrs[i].di_opcode)
+            return 0;
+        addr = blk->blk_instrs[i].di_next;
+    }
+    return 1;
+}
+
+
+// find the block at pc, using the successors recorded in the previous block if it is hot
+static BLOCK *nextBlock(BLOCK *prev, uint32_t pc)
+{
+    BLOCK *blk = NULL;
+    int slot = 0;
+
+    if (prev && (prev->blk_execCount >= BLOCK_HOT_THRESHOLD)) {
+        if (prev->blk_epoch != s_epoch) {
+            prev->blk_succ[0] = prev->blk_succ[1] = NULL;
+            prev->blk_epoch = s_epoch;
+        }
+        slot = (pc == prev->blk_end) ? 0 : 1;
+        if (prev->blk_succ[slot] && (prev->blk_succ[slot]->blk_start == pc)) {
+            ++s_stats.bcs_blocksChained;
+            return prev->blk_succ[slot];
+        }
+    }
+
+    if ((pc >= s_start) && (pc <= s_end) && ((blk = lookupBlock(pc)) == NULL))
+        blk = decodeBlock(pc);
+
+    // decodeBlock() might have flushed the cache, which retires prev (but doesn't free it yet)
+    if (blk && prev && prev->blk_valid && (prev->blk_execCount >= BLOCK_HOT_THRESHOLD))
+        prev->blk_succ[slot] = blk;
+    return blk;
+}
+
+
+// execute one instruction the same way m68k_execute() does
+static void executeInstruction(void)
+{
+    m68ki_trace_t1();
+    m68ki_use_data_space();
+    m68ki_instr_hook();
+    REG_PPC = REG_PC;
+    REG_IR = m68ki_read_imm_16();
+    if (s_pairStats)
+        countOpcodePair(REG_IR, REG_PPC);
+    m68ki_instruction_jump_table[REG_IR]();
+    USE_CYCLES(CYC_INSTRUCTION[REG_IR]);
+    m68ki_exception_if_trace();
+}
+
+
+// execute one decoded instruction
+static inline void executeDecoded(const DECODED_INSTR *di)
+{
+    m68ki_trace_t1();
+    m68ki_use_data_space();
+    m68ki_instr_hook();
+    REG_PPC = REG_PC;
+    REG_IR  = di->di_opcode;
+    REG_PC += 2;                            // what m68ki_read_imm_16() does (we don't emulate the prefetch queue)
+    if (s_pairStats)
+        countOpcodePair(REG_IR, REG_PPC);
+    di->di_handler();
+    USE_CYCLES(di->di_cycles);
+    m68ki_exception_if_trace();
+}
+
+
+// Execute all iterations of a loop idiom with a bulk operation, returns the number of iterations or 0 if the loop
+// must be executed normally. The flags are those of the last MOVE / CLR / TST and DBF / BNE leaves them alone.
+static uint32_t runIdiom(const BLOCK *blk)
+{
+    static const uint32_t moveSizes[4] = {0, 1, 4, 2}, clrSizes[4] = {1, 2, 4, 0};
+    uint16_t op = blk->blk_instrs[0].di_opcode, br = blk->blk_instrs[1].di_opcode;
+    uint32_t n, len, size;
+
+    if (blk->blk_idiom == IDIOM_SCAN) {
+        uint32_t *an = &REG_A[op & 7];
+        if (!m68k_bulk_scan(ADDRESS_68K(*an), &len))
+            return 0;
+        *an += len;
+        n = len;
+        FLAG_N = NFLAG_CLEAR;
+        FLAG_Z = ZFLAG_SET;
+        s_stats.bcs_scanIterations += n;
+    }
+    else {
+        uint32_t *dn = &REG_D[br & 7];
+        n = (*dn & 0xffff) + 1;
+        if (blk->blk_idiom == IDIOM_COPY) {
+            uint32_t *as = &REG_A[op & 7], *ad = &REG_A[(op >> 9) & 7];
+            uint32_t src = ADDRESS_68K(*as), dst = ADDRESS_68K(*ad);
+            size = moveSizes[(op >> 12) & 3];
+            len  = n * size;
+            if ((size > 1) && ((src | dst) & 1))
+                return 0;
+            // copying forward into the source area repeats its start (which memmove() doesn't do), and the loop
+            // itself must not be overwritten
+            if (((dst > src) && (dst < src + len)) || ((dst < blk->blk_end) && (dst + len > blk->blk_start)))
+                return 0;
+            if (!m68k_bulk_move(dst, src, len))
+                return 0;
+            *as += len;
+            *ad += len;
+            uint32_t res = (size == 1) ? m68ki_read_8(dst + len - 1) :
+                           (size == 2) ? m68ki_read_16(dst + len - 2) : m68ki_read_32(dst + len - 4);
+            FLAG_N = (size == 1) ? NFLAG_8(res) : (size == 2) ? NFLAG_16(res) : NFLAG_32(res);
+            FLAG_Z = res;
+            s_stats.bcs_copyIterations += n;
+        }
+        else {
+            uint32_t *ad = &REG_A[op & 7];
+            uint32_t dst = ADDRESS_68K(*ad);
+            size = clrSizes[(op >> 6) & 3];
+            len  = n * size;
+            if ((size > 1) && (dst & 1))
+                return 0;
+            if (((dst < blk->blk_end) && (dst + len > blk->blk_start)) || !m68k_bulk_fill(dst, 0, len))
+                return 0;
+            *ad += len;
+            FLAG_N = NFLAG_CLEAR;
+            FLAG_Z = ZFLAG_SET;
+            s_stats.bcs_fillIterations += n;
+        }
+        *dn = MASK_OUT_BELOW_16(*dn) | 0xffff;
+    }
+    FLAG_V = VFLAG_CLEAR;
+    FLAG_C = CFLAG_CLEAR;
+    REG_PPC = blk->blk_instrs[0].di_next;
+    REG_PC  = blk->blk_end;
+    USE_CYCLES(n * (blk->blk_instrs[0].di_cycles + blk->blk_instrs[1].di_cycles));
+    return n;
+}
+
+
+// Execute the instructions of a block, returns how often the block was executed. We leave the block as soon as the
+// PC is not where we expect it (because of an exception or a branch that was taken), the block has been invalidated
+// by a write of the current instruction or we have run out of cycles.
+static uint32_t executeBlock(const BLOCK *blk)
+{
+    const DECODED_INSTR *end = blk->blk_instrs + blk->blk_ninstrs;
+    uint32_t passes = 0;
+
+    // The statistics of opcode pairs would miss the iterations of the loop, so they are exact only without idioms.
+    if (blk->blk_idiom && s_loopIdioms && !s_pairStats && ((passes = runIdiom(blk)) > 0))
+        return passes;
+
+    do {
+        const DECODED_INSTR *di = blk->blk_instrs;
+        ++passes;
+        do
+            executeDecoded(di);
+        while ((REG_PC == di->di_next) && (++di < end) && blk->blk_valid && (GET_CYCLES() > 0));
+        // a loop consisting of just this block is executed again right away
+    } while ((REG_PC == blk->blk_start) && blk->blk_valid && (GET_CYCLES() > 0));
+    return passes;
+}
+
+
+// Execute one pass through a hot block (or all iterations of a loop idiom) from the cache and then the same number of
+// instructions with the interpreter, starting with the same registers and memory, and compare the results. The
+// writes to memory are recorded in the journal of the memory manager so they can be undone after the first run. The
+// result of the interpreter is kept. Returns the number of passes through the block (always 1).
+static uint32_t crossCheckBlock(const BLOCK *blk)
+{
+    const DECODED_INSTR *end = blk->blk_instrs + blk->blk_ninstrs;
+    const m68ki_cpu_core before = m68ki_cpu;
+    const int cycles = GET_CYCLES();
+    const int pairStats = s_pairStats;
+    uint32_t ninstrs = 0, iterations, regs[16], pc, sr, address;
+
+    m68k_start_journal();
+    if (blk->blk_idiom && s_loopIdioms && !s_pairStats && ((iterations = runIdiom(blk)) > 0))
+        ninstrs = 2 * iterations;
+    else {
+        for (const DECODED_INSTR *di = blk->blk_instrs; ; ++di) {
+            executeDecoded(di);
+            ninstrs += (di->di_flags & DI_COMBINED) ? end - di : 1;
+            if ((REG_PC != di->di_next) || (di + 1 == end) || !blk->blk_valid)
+                break;
+        }
+    }
+    m68k_undo_journal();
+    memcpy(regs, REG_DA, sizeof(regs));
+    pc = REG_PC;
+    sr = m68ki_get_sr();
+
+    m68ki_cpu = before;
+    SET_CYCLES(cycles);
+    s_pairStats = 0;                                // the opcodes have been counted by the first run
+    m68k_start_journal();
+    for (uint32_t i = 0; i < ninstrs; ++i)
+        executeInstruction();
+    s_pairStats = pairStats;
+
+    ++s_stats.bcs_blocksCrossChecked;
+    if (!m68k_compare_journal(&address) || (memcmp(regs, REG_DA, sizeof(regs)) != 0) || (pc != REG_PC) ||
+        (sr != m68ki_get_sr())) {
+        ++s_stats.bcs_crossCheckFailures;
+        s_stats.bcs_lastCrossCheckFailure = blk->blk_start;
+    }
+    return 1;
+}
+
+
+//
+// returns 1 if the CPU has executed a STOP instruction (Musashi has no function for that)
+//
+int m68k_is_stopped(void)
+{
+    return CPU_STOPPED != 0;
+}
+
+
+//
+// replacement for m68k_execute() which uses the block cache
+//
+int m68k_execute_blocks(int num_cycles)
+{
+    if (CPU_STOPPED) {
+        SET_CYCLES(0);
+        CPU_INT_CYCLES = 0;
+        return num_cycles;
+    }
+
+    SET_CYCLES(num_cycles);
+    m68ki_initial_cycles = num_cycles;
+    USE_CYCLES(CPU_INT_CYCLES);
+    CPU_INT_CYCLES = 0;
+    m68ki_set_address_error_trap();
+
+    BLOCK *prev = NULL;
+    do {
+        BLOCK *blk = nextBlock(prev, REG_PC);
+        if (blk && s_verify && (blk->blk_execCount >= BLOCK_HOT_THRESHOLD) && !verifyBlock(blk)) {
+            ++s_stats.bcs_verifyFailures;
+            m68k_invalidate_blocks(blk->blk_start, blk->blk_end - blk->blk_start);
+            blk = NULL;
+        }
+
+        if (blk) {
+            if (s_verify && (blk->blk_execCount >= BLOCK_HOT_THRESHOLD) && !callsOut(blk->blk_instrs[blk->blk_ninstrs - 1].di_opcode))
+                blk->blk_execCount += crossCheckBlock(blk);
+            else
+                blk->blk_execCount += executeBlock(blk);
+            ++s_stats.bcs_blocksExecuted;
+        }
+        else {
+            executeInstruction();
+            ++s_stats.bcs_instrsUncached;
+        }
+        prev = blk;
+
+        // The previous block might be among the retired ones, so we must not use it anymore.
+        if (s_retired) {
+            freeRetiredBlocks();
+            prev = NULL;
+        }
+    } while (GET_CYCLES() > 0);
+
+    REG_PPC = REG_PC;
+    USE_CYCLES(CPU_INT_CYCLES);
+    CPU_INT_CYCLES = 0;
+    return m68ki_initial_cycles - GET_CYCLES();
+}
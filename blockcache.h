@@ -0,0 +1,87 @@
+//
+// VADM - cache of predecoded basic blocks for the CPU emulation
+//
+// Copyright(C) 2017 Constantin Wiemer
+//
+
+
+#ifndef VADM_BLOCKCACHE_H
+#define VADM_BLOCKCACHE_H
+
+
+#include <stdint.h>
+
+
+// statistics of the block cache
+typedef struct
+{
+    uint32_t bcs_blocksDecoded;
+    uint32_t bcs_blocksInvalidated;
+    uint32_t bcs_blocksFlushed;
+    uint64_t bcs_blocksExecuted;
+    uint64_t bcs_instrsUncached;
+    uint64_t bcs_blocksChained;             // blocks found through the successors of a hot block
+    uint32_t bcs_verifyFailures;            // hot blocks whose code was changed without the cache noticing it
+    uint64_t bcs_blocksCrossChecked;        // executions of hot blocks compared with the interpreter
+    uint32_t bcs_crossCheckFailures;        // executions whose results differed from those of the interpreter
+    uint32_t bcs_lastCrossCheckFailure;     // address of the block that differed last
+    uint32_t bcs_instrsDropped;             // instructions made redundant by fusing
+    uint32_t bcs_sequencesCombined;         // MOVE.L (An)+,Dn / TST.L Dn / Bcc.S executed by one handler
+    uint32_t bcs_flagsDropped;              // TST / CMP instructions whose flags were never used
+    uint64_t bcs_pairsDropped;              // opcode pairs not counted because the table was full
+    uint64_t bcs_copyIterations;            // iterations of loop idioms executed as bulk operations (see runIdiom())
+    uint64_t bcs_fillIterations;
+    uint64_t bcs_scanIterations;
+} BLOCK_CACHE_STATS;
+
+// information about a hot block
+typedef struct
+{
+    uint32_t hbi_start;
+    uint32_t hbi_end;
+    uint32_t hbi_ninstrs;
+    uint32_t hbi_execCount;
+} HOT_BLOCK_INFO;
+
+// information about a pair of opcodes
+typedef struct
+{
+    uint16_t opi_first;
+    uint16_t opi_second;
+    uint32_t opi_address;                   // where the pair was seen first
+    uint64_t opi_count;
+} OPCODE_PAIR_INFO;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    void m68k_init_block_cache(uint32_t start, uint32_t end);
+    int m68k_execute_blocks(int num_cycles);
+    int m68k_is_stopped(void);
+    void m68k_invalidate_blocks(uint32_t address, uint32_t size);
+    void m68k_set_block_cache_verify(int verify);
+    void m68k_get_block_cache_stats(BLOCK_CACHE_STATS *stats);
+    int m68k_get_hot_blocks(HOT_BLOCK_INFO *info, int max);
+    void m68k_set_opcode_pair_stats(int enable);
+    int m68k_get_opcode_pairs(OPCODE_PAIR_INFO *info, int max);
+    void m68k_set_loop_idioms(int enable);
+
+    // bulk operations on memory for the loop idioms (implemented by the memory manager), they return 0 if the
+    // area is not plain RAM that is accessed directly
+    int m68k_bulk_move(uint32_t dst, uint32_t src, uint32_t len);
+    int m68k_bulk_fill(uint32_t dst, uint8_t value, uint32_t len);
+    int m68k_bulk_scan(uint32_t addr, uint32_t *len);
+
+    // journal of the writes to memory for the cross-check of hot blocks in verify mode (implemented by the memory
+    // manager)
+    void m68k_start_journal(void);
+    void m68k_undo_journal(void);
+    int m68k_compare_journal(uint32_t *address);
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif //VADM_BLOCKCACHE_H
@@ -6,6 +6,7 @@
 
 
 #include "cpu.h"
+#include "intercept.h"
 
 
 void m68k_instr_callback()
@@ -15,6 +16,10 @@ void m68k_instr_callback()
     unsigned int ipc, pc;
     unsigned int nbytes;
 
+    // This is called before every instruction, so don't disassemble anything unless it is actually logged.
+    if (!g_logger->isTraceEnabled())
+        return;
+
     ipc = pc = m68k_get_reg(NULL, M68K_REG_PC);
     nbytes = m68k_disassemble(instr, ipc, M68K_CPU_TYPE_68000);
     while (nbytes > 0) {
@@ -26,16 +31,51 @@ void m68k_instr_callback()
 }
 
 
-void m68k_trap_callback()
+//
+// handler for the line A opcodes in the jump tables of the libraries and at the entries of intercepted functions
+//
+// Each entry in a jump table consists of the opcode 0xA000, the offset of the routine as extension word and an RTS,
+// so the base of the library is the address of the entry + the offset. The handler calls the routine and then does
+// the RTS itself, so a library call costs just one instruction (and no exception). The opcode LINE_A_INTERCEPT is
+// followed by the index of the intercepted function (see intercept.h). The other line A opcodes are reserved for the
+// emulator.
+//
+void m68k_line_a_callback()
 {
-    unsigned int base = m68k_get_reg(NULL, M68K_REG_A6);
-    unsigned int offset = m68k_get_reg(NULL, M68K_REG_A6) - m68k_get_reg(NULL, M68K_REG_PC) + 2;
-    LOG4CXX_DEBUG(g_logger, Poco::format("trap occurred, base address = 0x%08x, offset = 0x%04x", base, offset));
-    if (g_libmap.find(base) != g_libmap.end())
-        g_libmap[base]->call(offset);
+    unsigned int pc     = m68k_get_reg(NULL, M68K_REG_PC);       // already points to the extension word
+    unsigned int opcode = m68k_get_reg(NULL, M68K_REG_IR);
+    if (opcode == 0xa000) {
+        unsigned int offset = m68k_read_16(pc);
+        unsigned int base   = pc - 2 + offset;
+        unsigned int slot   = LIB_BASE_TO_SLOT(base);
+        LOG4CXX_DEBUG(g_logger, Poco::format("library call, base address = 0x%08x, offset = 0x%04x", base, offset));
+        if ((slot < LIB_MAX_SLOTS) && (g_libtab[slot] != nullptr))
+            g_libtab[slot]->call(offset);
+        else {
+            LOG4CXX_ERROR(g_logger, Poco::format("library in slot %u not found in table of opened libraries", slot));
+            throw std::runtime_error("bad library call");
+        }
+    }
+    else if (opcode == LINE_A_INTERCEPT)
+        callIntercept(m68k_read_16(pc));
     else {
-        LOG4CXX_ERROR(g_logger, Poco::format("base address 0x%08x not found in map of opened libraries", base));
-        throw std::runtime_error("bad library call");
+        LOG4CXX_ERROR(g_logger, Poco::format("unknown line A opcode 0x%04x at address 0x%08x", opcode, pc - 2));
+        throw std::runtime_error("illegal instruction");
     }
+
+    // RTS
+    unsigned int sp = m68k_get_reg(NULL, M68K_REG_SP);
+    m68k_set_reg(M68K_REG_PC, m68k_read_32(sp));
+    m68k_set_reg(M68K_REG_SP, sp + 4);
+}
+
+
+//
+// install our handler for all line A opcodes in the jump table of Musashi (must be called after m68k_init())
+//
+void setupLibraryCalls()
+{
+    for (unsigned int opcode = 0xa000; opcode <= 0xafff; ++opcode)
+        m68ki_instruction_jump_table[opcode] = m68k_line_a_callback;
 }
 
@@ -19,15 +19,21 @@
 // global logger
 extern log4cxx::LoggerPtr g_logger;
 
-// global map of opened libraries
-extern std::map <uint32_t, AmiLibrary *> g_libmap;
+// global table of opened libraries (indexed by slot)
+extern AmiLibrary *g_libtab[LIB_MAX_SLOTS];
 
 
 extern "C"
 {
     void m68k_instr_callback();
-    void m68k_trap_callback();
+    void m68k_line_a_callback();
+
+    // jump table of Musashi (defined in m68kcpu.c)
+    extern void (*m68ki_instruction_jump_table[0x10000])(void);
 }
 
 
+void setupLibraryCalls();
+
+
 #endif //VADE_CPU_H
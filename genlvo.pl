@@ -0,0 +1,68 @@
+#!/usr/bin/perl
+#
+# VADM - generate the tables of the library routines (LVOs) from the .fd files of the NDK
+#
+# usage: genlvo.pl [--defines] <fd file> ... > lvotables.h
+#
+# For each .fd file (for example exec_lib.fd) a table EXEC_LIB_LVOS of LVO_ENTRY (see libs.h) is generated that
+# contains the name, the offset, public / private and the registers of the arguments for each routine. With
+# --defines, a macro LVO_<routine> with the (negative) offset is generated for each routine instead, which is used
+# by the example programs that call library routines from inline assembler.
+#
+# Copyright(C) 2017 Constantin Wiemer
+#
+
+
+use strict;
+use warnings;
+use File::Basename;
+
+my $MAX_ARGS = 14;      # LVO_MAX_ARGS in libs.h
+
+my $defines = @ARGV && ($ARGV[0] eq '--defines');
+shift(@ARGV) if $defines;
+
+print "//\n// generated by genlvo.pl from the .fd files of the NDK - do not edit\n//\n\n\n";
+foreach my $fd (@ARGV) {
+    open(my $fh, '<', $fd) or die "could not open $fd: $!\n";
+    my $table  = uc(basename($fd, '.fd')) . '_LVOS';
+    my $bias   = 0;
+    my $public = 'true';
+
+    print "constexpr LVO_ENTRY ${table}[] = {\n" unless $defines;
+    while (<$fh>) {
+        s/\s+$//;
+        next if /^\*/ || /^$/;
+        if (/^##bias\s+(\d+)/) {
+            $bias = $1;
+        }
+        elsif (/^##public/) {
+            $public = 'true';
+        }
+        elsif (/^##private/) {
+            $public = 'false';
+        }
+        elsif (/^##end/) {
+            last;
+        }
+        elsif (/^##/) {
+            # ##base and others are not needed
+        }
+        elsif (/^(\w+)\s*\([^)]*\)\s*\(([^)]*)\)/) {
+            my ($name, @regs) = ($1, map { 'M68K_REG_' . uc($_) } grep { $_ ne '' } split(/[,\/]/, $2));
+            die "$fd:$.: too many arguments for $name\n" if @regs > $MAX_ARGS;
+            if ($defines) {
+                printf "#define LVO_%s -%d\n", $name, $bias;
+            }
+            else {
+                printf "    {\"%s\", 0x%03x, %s, %d, {%s}},\n", $name, $bias, $public, scalar(@regs), join(', ', @regs);
+            }
+            $bias += 6;
+        }
+        else {
+            die "$fd:$.: could not parse line: $_\n";
+        }
+    }
+    print $defines ? "\n" : "};\n\n";
+    close($fh);
+}
@@ -0,0 +1,172 @@
+//
+// VADM - interception of functions of the program with native implementations
+//
+// Copyright(C) 2017 Constantin Wiemer
+//
+
+
+#include <algorithm>
+#include <log4cxx/logger.h>
+#include <Poco/Format.h>
+#include <Poco/StringTokenizer.h>
+#include "intercept.h"
+#include "memory.h"
+
+
+// global logger
+extern log4cxx::LoggerPtr g_logger;
+
+
+//
+// native implementations, the arguments are on the stack (C calling convention, SP points to the return address)
+// and the result is returned in D0, the memory of the VM is accessed with the bulk operations from memory.h (those
+// for the program itself when writing, so the protection of the pages applies like for the original functions)
+//
+
+static uint32_t arg(const uint32_t sp, const int n)
+{
+    return m68k_read_32(sp + 4 + 4 * n);
+}
+
+
+// void *memset(void *s, int c, size_t n)
+static uint32_t nativeMemset(const uint32_t sp)
+{
+    fillGuestChecked(arg(sp, 0), arg(sp, 1), arg(sp, 2));
+    return arg(sp, 0);
+}
+
+
+// size_t strlen(const char *s)
+static uint32_t nativeStrlen(const uint32_t sp)
+{
+    return guestStrlen(arg(sp, 0));
+}
+
+
+// int strcmp(const char *s1, const char *s2)
+static uint32_t nativeStrcmp(const uint32_t sp)
+{
+    const uint32_t s1 = arg(sp, 0), s2 = arg(sp, 1);
+    // s1 is compared including its NUL, so the first difference is at the end of s2 at the latest
+    checkGuestRange(s2, 0);
+    return compareGuest(s1, s2, std::min(guestStrlen(s1) + 1, ADDR_MEM_END - s2 + 1));
+}
+
+
+// char *strncpy(char *dest, const char *src, size_t n)
+static uint32_t nativeStrncpy(const uint32_t sp)
+{
+    const uint32_t dest = arg(sp, 0), src = arg(sp, 1), n = arg(sp, 2);
+    const uint32_t len = guestStrnlen(src, n);
+    moveInGuestChecked(dest, src, len);
+    fillGuestChecked(dest + len, 0, n - len);
+    return dest;
+}
+
+
+// char *strchr(const char *s, int c)
+static uint32_t nativeStrchr(const uint32_t sp)
+{
+    const uint32_t s = arg(sp, 0);
+    const uint8_t c = arg(sp, 1);
+    uint32_t pos;
+    return findInGuest(s, c, guestStrlen(s) + 1, pos) ? pos : 0;
+}
+
+
+// char *strncat(char *dest, const char *src, size_t n)
+static uint32_t nativeStrncat(const uint32_t sp)
+{
+    const uint32_t dest = arg(sp, 0), src = arg(sp, 1), n = arg(sp, 2);
+    const uint32_t end = dest + guestStrlen(dest);
+    const uint32_t len = guestStrnlen(src, n);
+    moveInGuestChecked(end, src, len);
+    fillGuestChecked(end + len, 0, 1);
+    return dest;
+}
+
+
+//
+// table of functions that can be intercepted
+//
+typedef struct
+{
+    const char *ic_name;
+    uint32_t   (*ic_func)(const uint32_t sp);
+    uint32_t   ic_address;                          // entry of the function in the program or 0 if not intercepted
+    uint64_t   ic_ncalls;
+} INTERCEPT_ENTRY;
+
+static INTERCEPT_ENTRY s_intercepts[] = {
+    {"memset",  nativeMemset,  0, 0},
+    {"strlen",  nativeStrlen,  0, 0},
+    {"strcmp",  nativeStrcmp,  0, 0},
+    {"strncpy", nativeStrncpy, 0, 0},
+    {"strchr",  nativeStrchr,  0, 0},
+    {"strncat", nativeStrncat, 0, 0}
+};
+
+#define NUM_INTERCEPTS (sizeof(s_intercepts) / sizeof(s_intercepts[0]))
+
+
+//
+// patch the entries of the functions in names (separated by commas, "all" for all functions in the table) found in
+// the symbols of the program
+// returns: false if one of the names is unknown
+//
+bool setupIntercepts(const std::string &names, const std::map <std::string, uint32_t> &symbols)
+{
+    Poco::StringTokenizer tokens(names, ",", Poco::StringTokenizer::TOK_TRIM | Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+    for (const std::string &name : tokens) {
+        bool found = false;
+        for (uint16_t i = 0; i < NUM_INTERCEPTS; ++i) {
+            if ((name != "all") && (name != s_intercepts[i].ic_name))
+                continue;
+            found = true;
+
+            // C compilers for the Amiga prefix the symbols with an underscore
+            auto sym = symbols.find(std::string("_") + s_intercepts[i].ic_name);
+            if (sym == symbols.end())
+                sym = symbols.find(s_intercepts[i].ic_name);
+            if (sym == symbols.end()) {
+                LOG4CXX_WARN(g_logger, "function " << s_intercepts[i].ic_name << " not found in the symbols of the program, not intercepting it");
+                continue;
+            }
+
+            const uint8_t patch[] = {LINE_A_INTERCEPT >> 8, LINE_A_INTERCEPT & 0xff, (uint8_t) (i >> 8), (uint8_t) (i & 0xff)};
+            copyToGuest(sym->second, patch, sizeof(patch));
+            s_intercepts[i].ic_address = sym->second;
+            LOG4CXX_INFO(g_logger, "intercepting function " << s_intercepts[i].ic_name << Poco::format(" at 0x%08x", sym->second));
+        }
+        if (!found) {
+            LOG4CXX_ERROR(g_logger, "function " << name << " can't be intercepted");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//
+// call the native implementation of an intercepted function (the caller does the RTS)
+//
+void callIntercept(const uint16_t index)
+{
+    if ((index >= NUM_INTERCEPTS) || (s_intercepts[index].ic_address == 0)) {
+        LOG4CXX_ERROR(g_logger, Poco::format("no intercepted function with index %u", (unsigned int) index));
+        throw std::runtime_error("bad intercept");
+    }
+    LOG4CXX_DEBUG(g_logger, "intercepted call of " << s_intercepts[index].ic_name);
+    ++s_intercepts[index].ic_ncalls;
+    m68k_set_reg(M68K_REG_D0, s_intercepts[index].ic_func(m68k_get_reg(NULL, M68K_REG_SP)));
+}
+
+
+void reportIntercepts()
+{
+    for (size_t i = 0; i < NUM_INTERCEPTS; ++i) {
+        if (s_intercepts[i].ic_address)
+            LOG4CXX_INFO(g_logger, "intercepted function " << s_intercepts[i].ic_name << " was called " << s_intercepts[i].ic_ncalls << " times");
+    }
+}
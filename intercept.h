@@ -0,0 +1,32 @@
+//
+// VADM - interception of functions of the program with native implementations
+//
+// Functions like strlen() or memset() that are linked into the program process one byte per several 68k
+// instructions. If the program contains symbols (HUNK_SYMBOL), the entries of these functions can be patched with
+// a line A opcode, so the emulator runs a native implementation instead, which works directly on the memory of the
+// VM. Functions are only intercepted on request (option --intercept).
+//
+// Copyright(C) 2017 Constantin Wiemer
+//
+
+
+#ifndef VADM_INTERCEPT_H
+#define VADM_INTERCEPT_H
+
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+
+// line A opcode that replaces the first instruction of an intercepted function, it is followed by the index of the
+// function in the table of intercepts as extension word (see m68k_line_a_callback())
+#define LINE_A_INTERCEPT 0xa001
+
+
+bool setupIntercepts(const std::string &names, const std::map <std::string, uint32_t> &symbols);
+void callIntercept(const uint16_t index);
+void reportIntercepts();
+
+
+#endif //VADM_INTERCEPT_H
@@ -6,6 +6,7 @@
 
 
 #include "libs.h"
+#include "lvotables.h"
 
 // Amiga OS headers
 // We need to define _SYS_TIME_H_ to avoid overriding the definition of struct timeval by <devices/timer.h>
@@ -21,183 +22,248 @@ extern "C"
 //
 // methods of AmiLibrary
 //
+AmiLibrary::~AmiLibrary()
+{
+    // the memory of the jump table becomes normal memory of the code area again
+    if (m_jumptabSize)
+        g_memmgr->mapPages(m_base - m_jumptabSize, m_base - 1, &g_codePageHandlers, true, false);
+}
+
+
 void AmiLibrary::call(const uint16_t offset)
 {
-    uint32_t rc;
-    if (m_funcmap.find(offset) != m_funcmap.end()) {
-		if (m_funcmap[offset] == nullptr) {
-	        LOG4CXX_ERROR(g_logger, Poco::format("library routine with offset 0x%x not implemented", (unsigned int) offset));
-            throw std::runtime_error("bad library call");
-		}
-        rc = (this->*m_funcmap[offset])();
-        m68k_set_reg(M68K_REG_D0, rc);
-    }
+    const uint16_t idx = offset / 6;
+    if (idx < m_image->m_functab.size())
+        m_image->m_functab[idx](this);
     else {
-        LOG4CXX_ERROR(g_logger, Poco::format("library routine with offset 0x%08x not found in map", (unsigned int) offset));
+        LOG4CXX_ERROR(g_logger, Poco::format("library routine with offset 0x%08x not found in table", (unsigned int) offset));
         throw std::runtime_error("bad library call");
     }
 }
 
 
 //
-// methods of ExecLibrary
+// shared handler for all routines that are not implemented
 //
+void AmiLibrary::notImplemented(AmiLibrary *lib)
+{
+    // The PC still points to the extension word of the line A opcode, which contains the offset.
+    const unsigned int offset = m68k_read_16(m68k_get_reg(NULL, M68K_REG_PC));
+    LOG4CXX_ERROR(g_logger, Poco::format("library routine with offset 0x%x not implemented", offset));
+    throw std::runtime_error("bad library call");
+}
+
+
+//
+// setup jump table (copy of the prebuilt image) and protect it against modifications by the program
+//
+void AmiLibrary::setupJumpTable(const uint32_t base, const LibraryImage &image)
+{
+    // We write directly into the memory because the pages might already be mapped read-only.
+    const uint32_t size = image.m_jumptab.size();
+    copyToGuest(base - size, image.m_jumptab.data(), size);
+    g_memmgr->mapPages(base - size, base - 1, &g_romPageHandlers, true, false);
+    m_image       = &image;
+    m_jumptabSize = size;
+}
+
 
-ExecLibrary::ExecLibrary(uint32_t base)
-{
-    // add functions to map
-    m_funcmap[0x228] = (FUNCPTR) &ExecLibrary::OpenLibrary;
-    m_funcmap[0x2ac] = (FUNCPTR) &ExecLibrary::AllocVec;
-    m_funcmap[0x2b2] = (FUNCPTR) &ExecLibrary::FreeVec;
-
-    // lines below have been generated with the following command line:
-    // grep syscall exec_pragmas.h | perl -nale 'print "m_funcmap[0x$F[3]] = nullptr;    // $F[2]"'
-	m_funcmap[0x1e] = nullptr;    // Supervisor
-	m_funcmap[0x48] = nullptr;    // InitCode
-	m_funcmap[0x4e] = nullptr;    // InitStruct
-	m_funcmap[0x54] = nullptr;    // MakeLibrary
-	m_funcmap[0x5a] = nullptr;    // MakeFunctions
-	m_funcmap[0x60] = nullptr;    // FindResident
-	m_funcmap[0x66] = nullptr;    // InitResident
-	m_funcmap[0x6c] = nullptr;    // Alert
-	m_funcmap[0x72] = nullptr;    // Debug
-	m_funcmap[0x78] = nullptr;    // Disable
-	m_funcmap[0x7e] = nullptr;    // Enable
-	m_funcmap[0x84] = nullptr;    // Forbid
-	m_funcmap[0x8a] = nullptr;    // Permit
-	m_funcmap[0x90] = nullptr;    // SetSR
-	m_funcmap[0x96] = nullptr;    // SuperState
-	m_funcmap[0x9c] = nullptr;    // UserState
-	m_funcmap[0xa2] = nullptr;    // SetIntVector
-	m_funcmap[0xa8] = nullptr;    // AddIntServer
-	m_funcmap[0xae] = nullptr;    // RemIntServer
-	m_funcmap[0xb4] = nullptr;    // Cause
-	m_funcmap[0xba] = nullptr;    // Allocate
-	m_funcmap[0xc0] = nullptr;    // Deallocate
-	m_funcmap[0xc6] = nullptr;    // AllocMem
-	m_funcmap[0xcc] = nullptr;    // AllocAbs
-	m_funcmap[0xd2] = nullptr;    // FreeMem
-	m_funcmap[0xd8] = nullptr;    // AvailMem
-	m_funcmap[0xde] = nullptr;    // AllocEntry
-	m_funcmap[0xe4] = nullptr;    // FreeEntry
-	m_funcmap[0xea] = nullptr;    // Insert
-	m_funcmap[0xf0] = nullptr;    // AddHead
-	m_funcmap[0xf6] = nullptr;    // AddTail
-	m_funcmap[0xfc] = nullptr;    // Remove
-	m_funcmap[0x102] = nullptr;    // RemHead
-	m_funcmap[0x108] = nullptr;    // RemTail
-	m_funcmap[0x10e] = nullptr;    // Enqueue
-	m_funcmap[0x114] = nullptr;    // FindName
-	m_funcmap[0x11a] = nullptr;    // AddTask
-	m_funcmap[0x120] = nullptr;    // RemTask
-    m_funcmap[0x126] = nullptr;    // FindTask
-	m_funcmap[0x12c] = nullptr;    // SetTaskPri
-	m_funcmap[0x132] = nullptr;    // SetSignal
-	m_funcmap[0x138] = nullptr;    // SetExcept
-	m_funcmap[0x13e] = nullptr;    // Wait
-	m_funcmap[0x144] = nullptr;    // Signal
-	m_funcmap[0x14a] = nullptr;    // AllocSignal
-	m_funcmap[0x150] = nullptr;    // FreeSignal
-	m_funcmap[0x156] = nullptr;    // AllocTrap
-	m_funcmap[0x15c] = nullptr;    // FreeTrap
-	m_funcmap[0x162] = nullptr;    // AddPort
-	m_funcmap[0x168] = nullptr;    // RemPort
-	m_funcmap[0x16e] = nullptr;    // PutMsg
-	m_funcmap[0x174] = nullptr;    // GetMsg
-	m_funcmap[0x17a] = nullptr;    // ReplyMsg
-	m_funcmap[0x180] = nullptr;    // WaitPort
-	m_funcmap[0x186] = nullptr;    // FindPort
-	m_funcmap[0x18c] = nullptr;    // AddLibrary
-	m_funcmap[0x192] = nullptr;    // RemLibrary
-	m_funcmap[0x198] = nullptr;    // OldOpenLibrary
-	m_funcmap[0x19e] = nullptr;    // CloseLibrary
-	m_funcmap[0x1a4] = nullptr;    // SetFunction
-	m_funcmap[0x1aa] = nullptr;    // SumLibrary
-	m_funcmap[0x1b0] = nullptr;    // AddDevice
-	m_funcmap[0x1b6] = nullptr;    // RemDevice
-	m_funcmap[0x1bc] = nullptr;    // OpenDevice
-	m_funcmap[0x1c2] = nullptr;    // CloseDevice
-	m_funcmap[0x1c8] = nullptr;    // DoIO
-	m_funcmap[0x1ce] = nullptr;    // SendIO
-	m_funcmap[0x1d4] = nullptr;    // CheckIO
-	m_funcmap[0x1da] = nullptr;    // WaitIO
-	m_funcmap[0x1e0] = nullptr;    // AbortIO
-	m_funcmap[0x1e6] = nullptr;    // AddResource
-	m_funcmap[0x1ec] = nullptr;    // RemResource
-	m_funcmap[0x1f2] = nullptr;    // OpenResource
-	m_funcmap[0x20a] = nullptr;    // RawDoFmt
-	m_funcmap[0x210] = nullptr;    // GetCC
-	m_funcmap[0x216] = nullptr;    // TypeOfMem
-	m_funcmap[0x21c] = nullptr;    // Procure
-	m_funcmap[0x222] = nullptr;    // Vacate
-	m_funcmap[0x22e] = nullptr;    // InitSemaphore
-	m_funcmap[0x234] = nullptr;    // ObtainSemaphore
-	m_funcmap[0x23a] = nullptr;    // ReleaseSemaphore
-	m_funcmap[0x240] = nullptr;    // AttemptSemaphore
-	m_funcmap[0x246] = nullptr;    // ObtainSemaphoreList
-	m_funcmap[0x24c] = nullptr;    // ReleaseSemaphoreList
-	m_funcmap[0x252] = nullptr;    // FindSemaphore
-	m_funcmap[0x258] = nullptr;    // AddSemaphore
-	m_funcmap[0x25e] = nullptr;    // RemSemaphore
-	m_funcmap[0x264] = nullptr;    // SumKickData
-	m_funcmap[0x26a] = nullptr;    // AddMemList
-	m_funcmap[0x270] = nullptr;    // CopyMem
-	m_funcmap[0x276] = nullptr;    // CopyMemQuick
-	m_funcmap[0x27c] = nullptr;    // CacheClearU
-	m_funcmap[0x282] = nullptr;    // CacheClearE
-	m_funcmap[0x288] = nullptr;    // CacheControl
-	m_funcmap[0x28e] = nullptr;    // CreateIORequest
-	m_funcmap[0x294] = nullptr;    // DeleteIORequest
-	m_funcmap[0x29a] = nullptr;    // CreateMsgPort
-	m_funcmap[0x2a0] = nullptr;    // DeleteMsgPort
-	m_funcmap[0x2a6] = nullptr;    // ObtainSemaphoreShared
-
-    // setup jump table (TRAP and RTS instructions for each routine)
-    for (auto it = m_funcmap.begin(); it != m_funcmap.end(); ++it) {
-        m68k_write_16(base - it->first, 0x4e40);
-        m68k_write_16(base - it->first + 2, 0x4e75);
+//
+// build the image of a library from the table of its routines and the implementations bound to them by name
+//
+AmiLibrary::LibraryImage::LibraryImage(const LVO_ENTRY *lvos, size_t nlvos, const FUNC_BINDING *bindings, size_t nbindings)
+{
+    uint16_t maxoff = 0;
+    for (size_t i = 0; i < nlvos; ++i) {
+        if (lvos[i].lvo_offset > maxoff)
+            maxoff = lvos[i].lvo_offset;
+    }
+
+    // table of routines, everything that is not bound to an implementation goes to notImplemented()
+    m_functab.assign(maxoff / 6 + 1, &AmiLibrary::notImplemented);
+    for (size_t i = 0; i < nbindings; ++i) {
+        size_t j = 0;
+        while ((j < nlvos) && (strcmp(lvos[j].lvo_name, bindings[i].fb_name) != 0))
+            ++j;
+        if (j == nlvos) {
+            LOG4CXX_FATAL(g_logger, "library routine " << bindings[i].fb_name << " not found in table of routines");
+            throw std::runtime_error("unknown library routine");
+        }
+
+        // check that the implementation expects its arguments in the registers listed in the .fd file
+        const uint8_t *regs;
+        const size_t nregs = bindings[i].fb_getRegs(&regs);
+        if ((nregs != lvos[j].lvo_nargs) || (memcmp(regs, lvos[j].lvo_regs, nregs) != 0)) {
+            LOG4CXX_FATAL(g_logger, "arguments of library routine " << bindings[i].fb_name << " don't match the table of routines");
+            throw std::runtime_error("bad binding of library routine");
+        }
+        m_functab[lvos[j].lvo_offset / 6] = bindings[i].fb_thunk;
+    }
+
+    // jump table, each entry consists of the line A opcode for library calls, the offset and RTS (see m68k_line_a_callback())
+    m_jumptab.assign(maxoff, 0);
+    for (size_t i = 0; i < nlvos; ++i) {
+        uint8_t *entry = m_jumptab.data() + maxoff - lvos[i].lvo_offset;
+        entry[0] = 0xa0;
+        entry[1] = 0x00;
+        entry[2] = lvos[i].lvo_offset >> 8;
+        entry[3] = lvos[i].lvo_offset & 0xff;
+        entry[4] = 0x4e;
+        entry[5] = 0x75;
     }
 }
 
 
+//
+// methods of ExecLibrary
+//
+
+ExecLibrary::ExecLibrary(uint32_t base) : AmiLibrary("exec.library", 40, base)
+{
+    static const FUNC_BINDING bindings[] = {
+        BIND(ExecLibrary, OpenLibrary),
+        BIND(ExecLibrary, CloseLibrary),
+        BIND(ExecLibrary, CopyMem),
+        BIND(ExecLibrary, CopyMemQuick),
+        BIND(ExecLibrary, AllocVec),
+        BIND(ExecLibrary, FreeVec)
+    };
+    static const LibraryImage image(EXEC_LIB_LVOS, bindings);
+    setupJumpTable(base, image);
+}
+
+
 //
 // OpenLibrary
 // A1: library name
-// D0: version (not used)
+// D0: minimum version
 // returns: pointer to library or 0
 //
-uint32_t ExecLibrary::OpenLibrary()
+uint32_t ExecLibrary::OpenLibrary(GuestStr<A1> libname, U32<D0> version)
 {
     LOG4CXX_DEBUG(g_logger, "ExecLibrary::OpenLibrary() has been called");
-    const char *libname    = (const char *) PTR_M68K_TO_HOST(m68k_get_reg(NULL, M68K_REG_A1));
-    const uint32_t version = m68k_get_reg(NULL, M68K_REG_D0);
-    LOG4CXX_DEBUG(g_logger, "library name = " << libname << ", version = " << version);
+    LOG4CXX_DEBUG(g_logger, "library name = " << libname.str << ", version = " << version);
+
+    // library already open?
+    int freeSlot = -1;
+    for (int slot = 0; slot < LIB_MAX_SLOTS; ++slot) {
+        AmiLibrary *lib = g_libtab[slot];
+        if (lib == nullptr) {
+            if (freeSlot < 0)
+                freeSlot = slot;
+        }
+        else if (lib->getName() == libname.str) {
+            if (lib->getVersion() < version) {
+                LOG4CXX_WARN(g_logger, "version " << version << " of " << libname.str << " requested but only version " << lib->getVersion() << " is available");
+                return 0;
+            }
+            ++lib->m_openCount;
+            return lib->getBase();
+        }
+    }
+    if (freeSlot < 0) {
+        LOG4CXX_ERROR(g_logger, "no free slot for library " << libname.str);
+        return 0;
+    }
 
-    if (strcmp(libname, "dos.library") == 0) {
-        LOG4CXX_DEBUG(g_logger, "opening dos.library");
-        g_libmap[ADDR_DOS_BASE] = new DOSLibrary(ADDR_DOS_BASE);
-        return ADDR_DOS_BASE;
+    // create it (built-in library or plugin)
+    const uint32_t base = LIB_SLOT_TO_BASE(freeSlot);
+    AmiLibrary *lib;
+    if (libname.str == "dos.library")
+        lib = new DOSLibrary(base);
+    else if (libname.str == "utility.library")
+        lib = new UtilityLibrary(base);
+    else if (libname.str == "mathieeedoubbas.library")
+        lib = new MathIeeeDoubBasLibrary(base);
+    else if (libname.str == "mathieeedoubtrans.library")
+        lib = new MathIeeeDoubTransLibrary(base);
+    else if (libname.str == "mathffp.library")
+        lib = new MathFFPLibrary(base);
+    else if ((lib = PluginLibrary::create(libname.str, base)) == nullptr) {
+        LOG4CXX_ERROR(g_logger, "library not implemented: " << libname.str);
+        return 0;
     }
-    else {
-        LOG4CXX_ERROR(g_logger, "library not implemented: " << libname);
-        throw std::runtime_error("library not implemented");
+    if (lib->getVersion() < version) {
+        LOG4CXX_WARN(g_logger, "version " << version << " of " << libname.str << " requested but only version " << lib->getVersion() << " is available");
+        delete lib;
+        return 0;
+    }
+    LOG4CXX_DEBUG(g_logger, Poco::format("opened %s in slot %d, base address = 0x%08x", libname.str, freeSlot, base));
+    lib->m_openCount = 1;
+    g_libtab[freeSlot] = lib;
+    return base;
+}
+
+
+//
+// CloseLibrary
+// A1: pointer to library (may be 0)
+//
+void ExecLibrary::CloseLibrary(GuestPtr<A1> library)
+{
+    LOG4CXX_DEBUG(g_logger, "ExecLibrary::CloseLibrary() has been called");
+    if (library == 0)
+        return;
+
+    const uint32_t slot = LIB_BASE_TO_SLOT(library);
+    AmiLibrary *lib;
+    if ((library < ADDR_EXEC_BASE) || (slot >= LIB_MAX_SLOTS) || ((lib = g_libtab[slot]) == nullptr) || (lib->getBase() != library)) {
+        LOG4CXX_ERROR(g_logger, Poco::format("CloseLibrary() called for 0x%08x, which is not an open library", (uint32_t) library));
+        throw std::runtime_error("bad library call");
+    }
+
+    // Exec itself is never closed, all other libraries are removed as soon as nobody uses them anymore
+    if ((lib->m_openCount > 0) && (--lib->m_openCount == 0) && (slot != LIB_BASE_TO_SLOT(ADDR_EXEC_BASE))) {
+        LOG4CXX_DEBUG(g_logger, "removing library " << lib->getName());
+        g_libtab[slot] = nullptr;
+        delete lib;
     }
 }
 
 
-uint32_t ExecLibrary::AllocVec()
+//
+// CopyMem
+// A0: source
+// A1: destination
+// D0: number of bytes
+//
+void ExecLibrary::CopyMem(GuestPtr<A0> source, GuestPtr<A1> dest, U32<D0> size)
+{
+    LOG4CXX_DEBUG(g_logger, "ExecLibrary::CopyMem() has been called");
+    LOG4CXX_DEBUG(g_logger, Poco::format("source = 0x%08x, dest = 0x%08x, size = %u", (uint32_t) source, (uint32_t) dest, (uint32_t) size));
+
+    // The original does not handle overlapping areas, but there is no reason to be worse than memmove() here.
+    moveInGuestChecked(dest, source, size);
+}
+
+
+//
+// CopyMemQuick
+// A0: source (long word aligned)
+// A1: destination (long word aligned)
+// D0: number of bytes (multiple of 4)
+//
+void ExecLibrary::CopyMemQuick(GuestPtr<A0> source, GuestPtr<A1> dest, U32<D0> size)
+{
+    LOG4CXX_DEBUG(g_logger, "ExecLibrary::CopyMemQuick() has been called");
+    LOG4CXX_DEBUG(g_logger, Poco::format("source = 0x%08x, dest = 0x%08x, size = %u", (uint32_t) source, (uint32_t) dest, (uint32_t) size));
+    if ((source & 3) || (dest & 3) || (size & 3))
+        LOG4CXX_WARN(g_logger, "CopyMemQuick() called with unaligned addresses or size");
+    moveInGuestChecked(dest, source, size);
+}
+
+
+uint32_t ExecLibrary::AllocVec(U32<D0> size, U32<D1> flags)
 {
     LOG4CXX_DEBUG(g_logger, "ExecLibrary::AllocVec() has been called");
-    const uint32_t size  = m68k_get_reg(NULL, M68K_REG_D0);
-    const uint32_t flags = m68k_get_reg(NULL, M68K_REG_D1);
-    LOG4CXX_DEBUG(g_logger, "size = " << size << ", flags = " << Poco::format("0x%08x", flags));
+    LOG4CXX_DEBUG(g_logger, "size = " << size << ", flags = " << Poco::format("0x%08x", (uint32_t) flags));
 
     try {
-        uint8_t * ptr = g_memmgr->alloc(size);
+        const uint32_t ptr = PTR_HOST_TO_M68K(g_memmgr->alloc(size));
         // We ignore all flags except MEMF_CLEAR
         if (flags & MEMF_CLEAR)
-            memset(ptr, 0, size);
-        return PTR_HOST_TO_M68K(ptr);
+            fillGuest(ptr, 0, size);
+        return ptr;
     }
     catch (std::exception &e) {
         return 0;
@@ -206,14 +272,15 @@ uint32_t ExecLibrary::AllocVec()
 }
 
 
-uint32_t ExecLibrary::FreeVec()
+void ExecLibrary::FreeVec(GuestPtr<A1> ptr)
 {
     LOG4CXX_DEBUG(g_logger, "ExecLibrary::FreeVec() has been called");
-    const uint32_t ptr = m68k_get_reg(NULL, M68K_REG_A1);
-    LOG4CXX_DEBUG(g_logger, Poco::format("ptr = 0x%08x", ptr));
+    LOG4CXX_DEBUG(g_logger, Poco::format("ptr = 0x%08x", (uint32_t) ptr));
 
+    // freeing NULL is allowed and does nothing
+    if (ptr == 0)
+        return;
     g_memmgr->free(PTR_M68K_TO_HOST(ptr));
-    return 0;
 }
 
 
@@ -221,216 +288,81 @@ uint32_t ExecLibrary::FreeVec()
 // methods of DOSLibrary
 //
 
-DOSLibrary::DOSLibrary(uint32_t base) {
-    m_funcmap[0x3b4] = (FUNCPTR) & DOSLibrary::PutStr;
-    m_funcmap[0x054] = (FUNCPTR) & DOSLibrary::Lock;
-    m_funcmap[0x05a] = (FUNCPTR) & DOSLibrary::UnLock;
-    m_funcmap[0x066] = (FUNCPTR) & DOSLibrary::Examine;
-    m_funcmap[0x06c] = (FUNCPTR) & DOSLibrary::ExNext;
-    m_funcmap[0x084] = (FUNCPTR) & DOSLibrary::IoErr;
-    m_funcmap[0x36] = (FUNCPTR) & DOSLibrary::Input;
-    m_funcmap[0x3c] = (FUNCPTR) & DOSLibrary::Output;
-    m_funcmap[0x30] = (FUNCPTR) & DOSLibrary::Write;
-
-    // lines below have been generated with the following command line:
-    // grep libcall dos_pragmas.h | perl -nale 'print "m_funcmap[0x$F[4]] = nullptr;    // $F[3]"'
-    m_funcmap[0x1e] = nullptr;    // Open
-    m_funcmap[0x24] = nullptr;    // Close
-    m_funcmap[0x2a] = nullptr;    // Read
-    m_funcmap[0x42] = nullptr;    // Seek
-    m_funcmap[0x48] = nullptr;    // DeleteFile
-    m_funcmap[0x4e] = nullptr;    // Rename
-    m_funcmap[0x60] = nullptr;    // DupLock
-    m_funcmap[0x72] = nullptr;    // Info
-    m_funcmap[0x78] = nullptr;    // CreateDir
-    m_funcmap[0x7e] = nullptr;    // CurrentDir
-    m_funcmap[0x8a] = nullptr;    // CreateProc
-    m_funcmap[0x90] = nullptr;    // Exit
-    m_funcmap[0x96] = nullptr;    // LoadSeg
-    m_funcmap[0x9c] = nullptr;    // UnLoadSeg
-    m_funcmap[0xae] = nullptr;    // DeviceProc
-    m_funcmap[0xb4] = nullptr;    // SetComment
-    m_funcmap[0xba] = nullptr;    // SetProtection
-    m_funcmap[0xc0] = nullptr;    // DateStamp
-    m_funcmap[0xc6] = nullptr;    // Delay
-    m_funcmap[0xcc] = nullptr;    // WaitForChar
-    m_funcmap[0xd2] = nullptr;    // ParentDir
-    m_funcmap[0xd8] = nullptr;    // IsInteractive
-    m_funcmap[0xde] = nullptr;    // Execute
-    m_funcmap[0xe4] = nullptr;    // AllocDosObject
-    m_funcmap[0xe4] = nullptr;    // AllocDosObjectTagList
-    m_funcmap[0xea] = nullptr;    // FreeDosObject
-    m_funcmap[0xf0] = nullptr;    // DoPkt
-    m_funcmap[0xf0] = nullptr;    // DoPkt0
-    m_funcmap[0xf0] = nullptr;    // DoPkt1
-    m_funcmap[0xf0] = nullptr;    // DoPkt2
-    m_funcmap[0xf0] = nullptr;    // DoPkt3
-    m_funcmap[0xf0] = nullptr;    // DoPkt4
-    m_funcmap[0xf6] = nullptr;    // SendPkt
-    m_funcmap[0xfc] = nullptr;    // WaitPkt
-    m_funcmap[0x102] = nullptr;    // ReplyPkt
-    m_funcmap[0x108] = nullptr;    // AbortPkt
-    m_funcmap[0x10e] = nullptr;    // LockRecord
-    m_funcmap[0x114] = nullptr;    // LockRecords
-    m_funcmap[0x11a] = nullptr;    // UnLockRecord
-    m_funcmap[0x120] = nullptr;    // UnLockRecords
-    m_funcmap[0x126] = nullptr;    // SelectInput
-    m_funcmap[0x12c] = nullptr;    // SelectOutput
-    m_funcmap[0x132] = nullptr;    // FGetC
-    m_funcmap[0x138] = nullptr;    // FPutC
-    m_funcmap[0x13e] = nullptr;    // UnGetC
-    m_funcmap[0x144] = nullptr;    // FRead
-    m_funcmap[0x14a] = nullptr;    // FWrite
-    m_funcmap[0x150] = nullptr;    // FGets
-    m_funcmap[0x156] = nullptr;    // FPuts
-    m_funcmap[0x15c] = nullptr;    // VFWritef
-    m_funcmap[0x162] = nullptr;    // VFPrintf
-    m_funcmap[0x168] = nullptr;    // Flush
-    m_funcmap[0x16e] = nullptr;    // SetVBuf
-    m_funcmap[0x174] = nullptr;    // DupLockFromFH
-    m_funcmap[0x17a] = nullptr;    // OpenFromLock
-    m_funcmap[0x180] = nullptr;    // ParentOfFH
-    m_funcmap[0x186] = nullptr;    // ExamineFH
-    m_funcmap[0x18c] = nullptr;    // SetFileDate
-    m_funcmap[0x192] = nullptr;    // NameFromLock
-    m_funcmap[0x198] = nullptr;    // NameFromFH
-    m_funcmap[0x19e] = nullptr;    // SplitName
-    m_funcmap[0x1a4] = nullptr;    // SameLock
-    m_funcmap[0x1aa] = nullptr;    // SetMode
-    m_funcmap[0x1b0] = nullptr;    // ExAll
-    m_funcmap[0x1b6] = nullptr;    // ReadLink
-    m_funcmap[0x1bc] = nullptr;    // MakeLink
-    m_funcmap[0x1c2] = nullptr;    // ChangeMode
-    m_funcmap[0x1c8] = nullptr;    // SetFileSize
-    m_funcmap[0x1ce] = nullptr;    // SetIoErr
-    m_funcmap[0x1d4] = nullptr;    // Fault
-    m_funcmap[0x1da] = nullptr;    // PrintFault
-    m_funcmap[0x1e0] = nullptr;    // ErrorReport
-    m_funcmap[0x1ec] = nullptr;    // Cli
-    m_funcmap[0x1f2] = nullptr;    // CreateNewProc
-    m_funcmap[0x1f2] = nullptr;    // CreateNewProcTagList
-    m_funcmap[0x1f8] = nullptr;    // RunCommand
-    m_funcmap[0x1fe] = nullptr;    // GetConsoleTask
-    m_funcmap[0x204] = nullptr;    // SetConsoleTask
-    m_funcmap[0x20a] = nullptr;    // GetFileSysTask
-    m_funcmap[0x210] = nullptr;    // SetFileSysTask
-    m_funcmap[0x216] = nullptr;    // GetArgStr
-    m_funcmap[0x21c] = nullptr;    // SetArgStr
-    m_funcmap[0x222] = nullptr;    // FindCliProc
-    m_funcmap[0x228] = nullptr;    // MaxCli
-    m_funcmap[0x22e] = nullptr;    // SetCurrentDirName
-    m_funcmap[0x234] = nullptr;    // GetCurrentDirName
-    m_funcmap[0x23a] = nullptr;    // SetProgramName
-    m_funcmap[0x240] = nullptr;    // GetProgramName
-    m_funcmap[0x246] = nullptr;    // SetPrompt
-    m_funcmap[0x24c] = nullptr;    // GetPrompt
-    m_funcmap[0x252] = nullptr;    // SetProgramDir
-    m_funcmap[0x258] = nullptr;    // GetProgramDir
-    m_funcmap[0x25e] = nullptr;    // SystemTagList
-    m_funcmap[0x25e] = nullptr;    // System
-    m_funcmap[0x264] = nullptr;    // AssignLock
-    m_funcmap[0x26a] = nullptr;    // AssignLate
-    m_funcmap[0x270] = nullptr;    // AssignPath
-    m_funcmap[0x276] = nullptr;    // AssignAdd
-    m_funcmap[0x27c] = nullptr;    // RemAssignList
-    m_funcmap[0x282] = nullptr;    // GetDeviceProc
-    m_funcmap[0x288] = nullptr;    // FreeDeviceProc
-    m_funcmap[0x28e] = nullptr;    // LockDosList
-    m_funcmap[0x294] = nullptr;    // UnLockDosList
-    m_funcmap[0x29a] = nullptr;    // AttemptLockDosList
-    m_funcmap[0x2a0] = nullptr;    // RemDosEntry
-    m_funcmap[0x2a6] = nullptr;    // AddDosEntry
-    m_funcmap[0x2ac] = nullptr;    // FindDosEntry
-    m_funcmap[0x2b2] = nullptr;    // NextDosEntry
-    m_funcmap[0x2b8] = nullptr;    // MakeDosEntry
-    m_funcmap[0x2be] = nullptr;    // FreeDosEntry
-    m_funcmap[0x2c4] = nullptr;    // IsFileSystem
-    m_funcmap[0x2ca] = nullptr;    // Format
-    m_funcmap[0x2d0] = nullptr;    // Relabel
-    m_funcmap[0x2d6] = nullptr;    // Inhibit
-    m_funcmap[0x2dc] = nullptr;    // AddBuffers
-    m_funcmap[0x2e2] = nullptr;    // CompareDates
-    m_funcmap[0x2e8] = nullptr;    // DateToStr
-    m_funcmap[0x2ee] = nullptr;    // StrToDate
-    m_funcmap[0x2f4] = nullptr;    // InternalLoadSeg
-    m_funcmap[0x2fa] = nullptr;    // InternalUnLoadSeg
-    m_funcmap[0x300] = nullptr;    // NewLoadSeg
-    m_funcmap[0x300] = nullptr;    // NewLoadSegTagList
-    m_funcmap[0x306] = nullptr;    // AddSegment
-    m_funcmap[0x30c] = nullptr;    // FindSegment
-    m_funcmap[0x312] = nullptr;    // RemSegment
-    m_funcmap[0x318] = nullptr;    // CheckSignal
-    m_funcmap[0x31e] = nullptr;    // ReadArgs
-    m_funcmap[0x324] = nullptr;    // FindArg
-    m_funcmap[0x32a] = nullptr;    // ReadItem
-    m_funcmap[0x330] = nullptr;    // StrToLong
-    m_funcmap[0x336] = nullptr;    // MatchFirst
-    m_funcmap[0x33c] = nullptr;    // MatchNext
-    m_funcmap[0x342] = nullptr;    // MatchEnd
-    m_funcmap[0x348] = nullptr;    // ParsePattern
-    m_funcmap[0x34e] = nullptr;    // MatchPattern
-    m_funcmap[0x35a] = nullptr;    // FreeArgs
-    m_funcmap[0x366] = nullptr;    // FilePart
-    m_funcmap[0x36c] = nullptr;    // PathPart
-    m_funcmap[0x372] = nullptr;    // AddPart
-    m_funcmap[0x378] = nullptr;    // StartNotify
-    m_funcmap[0x37e] = nullptr;    // EndNotify
-    m_funcmap[0x384] = nullptr;    // SetVar
-    m_funcmap[0x38a] = nullptr;    // GetVar
-    m_funcmap[0x390] = nullptr;    // DeleteVar
-    m_funcmap[0x396] = nullptr;    // FindVar
-    m_funcmap[0x3a2] = nullptr;    // CliInitNewcli
-    m_funcmap[0x3a8] = nullptr;    // CliInitRun
-    m_funcmap[0x3ae] = nullptr;    // WriteChars
-    m_funcmap[0x3ba] = nullptr;    // VPrintf
-    m_funcmap[0x3c6] = nullptr;    // ParsePatternNoCase
-    m_funcmap[0x3cc] = nullptr;    // MatchPatternNoCase
-    m_funcmap[0x3d8] = nullptr;    // SameDevice
-    m_funcmap[0x3de] = nullptr;    // ExAllEnd
-    m_funcmap[0x3e4] = nullptr;    // SetOwner
-
-    // setup jump table (TRAP and RTS instructions for each routine)
-    for (auto it = m_funcmap.begin(); it != m_funcmap.end(); ++it) {
-        m68k_write_16(base - it->first, 0x4e40);
-        m68k_write_16(base - it->first + 2, 0x4e75);
-    }
-}
-
-
-void DOSLibrary::getFileInfo(const Poco::File &obj, struct FileInfoBlock *fib)
+DOSLibrary::DOSLibrary(uint32_t base)
+    : AmiLibrary("dos.library", 40, base), m_errno(0),
+      m_lockPool(g_memmgr, "FileLock", sizeof(struct FileLock)),
+      m_fhPool(g_memmgr, "FileHandle", sizeof(struct FileHandle)),
+      m_fibPool(g_memmgr, "FileInfoBlock", sizeof(struct FileInfoBlock)),
+      m_input(0), m_output(0)
+{
+    static const FUNC_BINDING bindings[] = {
+        BIND(DOSLibrary, Write),
+        BIND(DOSLibrary, Input),
+        BIND(DOSLibrary, Output),
+        BIND(DOSLibrary, Lock),
+        BIND(DOSLibrary, UnLock),
+        BIND(DOSLibrary, Examine),
+        BIND(DOSLibrary, ExNext),
+        BIND(DOSLibrary, IoErr),
+        BIND(DOSLibrary, AllocDosObject),
+        BIND(DOSLibrary, FreeDosObject),
+        BIND(DOSLibrary, PutStr)
+    };
+    static const LibraryImage image(DOS_LIB_LVOS, bindings);
+    setupJumpTable(base, image);
+}
+
+
+DOSLibrary::~DOSLibrary()
+{
+    if (m_input)
+        m_fhPool.free(m_input);
+    if (m_output)
+        m_fhPool.free(m_output);
+}
+
+
+//
+// fill the FileInfoBlock at address fib (in guest memory) with the information about the file / directory
+//
+void DOSLibrary::getFileInfo(const Poco::File &obj, const uint32_t fib)
 {
     // file / directory name
-    strncpy(fib->fib_FileName, Poco::Path(obj.path()).getFileName().c_str(), 100);
+    writeGuestString(fib + offsetof(struct FileInfoBlock, fib_FileName), Poco::Path(obj.path()).getFileName().c_str(), 100);
 
     // type
-    if (obj.isDirectory())
-        fib->fib_DirEntryType = +1;
-    else
-        fib->fib_DirEntryType = -1;                         // We treat special files as regular files
+    if (obj.isDirectory()) {
+        WRITE_LONG_FIELD(fib, struct FileInfoBlock, fib_DirEntryType, +1);
+    }
+    else {
+        WRITE_LONG_FIELD(fib, struct FileInfoBlock, fib_DirEntryType, -1);     // We treat special files as regular files
+    }
 
     // size
-    if (obj.isFile())
-        fib->fib_Size = SWAP_BYTES(obj.getSize());         // This is only correct if the file is smaller than 4GB
-    else
+    if (obj.isFile()) {
+        WRITE_LONG_FIELD(fib, struct FileInfoBlock, fib_Size, obj.getSize());  // This is only correct if the file is smaller than 4GB
+    }
+    else {
         // TODO: What was the size of directory in AmigaDOS?
-        fib->fib_Size = 0;
+        WRITE_LONG_FIELD(fib, struct FileInfoBlock, fib_Size, 0);
+    }
 
     // flags (only the ones that are available in Unix / Windows)
-    fib->fib_Protection = 0;
+    uint32_t protection = 0;
     if (!obj.canRead())
-        fib->fib_Protection |= FIBF_READ;
+        protection |= FIBF_READ;
     if (!obj.canWrite())
-        fib->fib_Protection |= FIBF_WRITE;
+        protection |= FIBF_WRITE;
     if (!obj.canExecute())
-        fib->fib_Protection |= FIBF_EXECUTE;
-    fib->fib_Protection = SWAP_BYTES(fib->fib_Protection);
+        protection |= FIBF_EXECUTE;
+    WRITE_LONG_FIELD(fib, struct FileInfoBlock, fib_Protection, protection);
 
     // timestamp
     int tzdiff;
     auto tsdiff = Poco::DateTime(obj.getLastModified()) - Poco::DateTimeParser::parse("%d/%m/%Y %H:%M:%S %Z", "01/01/1978 00:00:00 GMT", tzdiff);
-    fib->fib_Date.ds_Days   = SWAP_BYTES(tsdiff.days());
-    fib->fib_Date.ds_Minute = SWAP_BYTES(tsdiff.hours() * 60 + tsdiff.minutes());
-    fib->fib_Date.ds_Tick   = SWAP_BYTES(tsdiff.seconds() * 50);
+    WRITE_LONG_FIELD(fib, struct FileInfoBlock, fib_Date.ds_Days, tsdiff.days());
+    WRITE_LONG_FIELD(fib, struct FileInfoBlock, fib_Date.ds_Minute, tsdiff.hours() * 60 + tsdiff.minutes());
+    WRITE_LONG_FIELD(fib, struct FileInfoBlock, fib_Date.ds_Tick, tsdiff.seconds() * 50);
 }
 
 
@@ -439,11 +371,10 @@ void DOSLibrary::getFileInfo(const Poco::File &obj, struct FileInfoBlock *fib)
 // D1: string
 // returns: 0 or -1 in case of an error
 //
-uint32_t DOSLibrary::PutStr()
+int32_t DOSLibrary::PutStr(GuestStr<D1> str)
 {
     LOG4CXX_DEBUG(g_logger, "DOSLibrary::PutStr() has been called");
-    const char *str = (const char *) PTR_M68K_TO_HOST(m68k_get_reg(NULL, M68K_REG_D1));
-    std::cout << str;
+    std::cout << str.str;
     std::cout.flush();
     return 0;
 }
@@ -455,49 +386,46 @@ uint32_t DOSLibrary::PutStr()
 // D2: access mode (not used)
 // returns: BPTR to struct FileLock or 0 in case of an error
 //
-uint32_t DOSLibrary::Lock()
+BcplAddr DOSLibrary::Lock(GuestStr<D1> path, I32<D2> mode)
 {
     LOG4CXX_DEBUG(g_logger, "DOSLibrary::Lock() has been called");
-    const char *path    = (const char *) PTR_M68K_TO_HOST(m68k_get_reg(NULL, M68K_REG_D1));
-    const uint32_t mode = m68k_get_reg(NULL, M68K_REG_D2);
-    LOG4CXX_DEBUG(g_logger, "path = " << path << ", mode = " << mode);
+    LOG4CXX_DEBUG(g_logger, "path = " << path.str << ", mode = " << mode);
 
     // As Lock() was typically used to Examine() a file or directory, and this does not require a lock on neither
     // Unix nor Windows, we don't really lock anything here but only create a Poco::File object (which can be used
     // in Examine() to create a Poco::DirectoryIterator) and store the pointer in the fl_Key field of the FileLock
     // structure to associate the lock with the file or directory. We set fl_Task to NULL because no DirectoryIterator
     // object has been created yet.
-    Poco::File *obj = new Poco::File(path);
+    Poco::File *obj = new Poco::File(path.str);
     if (obj->exists()) {
-        LOG4CXX_DEBUG(g_logger, "creating lock for file / dir '" << path << "'");
-        struct FileLock *lock = ((struct FileLock *) g_memmgr->alloc(sizeof(struct FileLock)));
-        lock->fl_Key    = (uint32_t) obj;
-        lock->fl_Access = SWAP_BYTES(mode);
-        lock->fl_Task   = NULL;
-        return PTR_C_TO_BCPL(PTR_HOST_TO_M68K(lock));
+        LOG4CXX_DEBUG(g_logger, "creating lock for file / dir '" << path.str << "'");
+        const uint32_t lock = m_lockPool.alloc();
+        WRITE_LONG_FIELD(lock, struct FileLock, fl_Key, (uint32_t) obj);
+        WRITE_LONG_FIELD(lock, struct FileLock, fl_Access, mode);
+        WRITE_LONG_FIELD(lock, struct FileLock, fl_Task, 0);
+        return {lock};
 
     }
     else {
-        LOG4CXX_ERROR(g_logger, "could not create lock for file / dir '" << path << "' because it does not exist");
-        return 0;
+        LOG4CXX_ERROR(g_logger, "could not create lock for file / dir '" << path.str << "' because it does not exist");
+        delete obj;
+        return {0};
     }
 }
 
 
-uint32_t DOSLibrary::UnLock()
+void DOSLibrary::UnLock(BcplPtr<D1> lock)
 {
     LOG4CXX_DEBUG(g_logger, "DOSLibrary::UnLock() has been called");
-    const struct FileLock *lock = (struct FileLock *) PTR_M68K_TO_HOST(PTR_BCPL_TO_C(m68k_get_reg(NULL, M68K_REG_D1)));
 
-    Poco::File *obj = (Poco::File *) lock->fl_Key;
+    Poco::File *obj = (Poco::File *) READ_LONG_FIELD(lock, struct FileLock, fl_Key);
     LOG4CXX_DEBUG(g_logger, "unlocking file / dir '" << obj->path() << "'");
     delete obj;
-    if (lock->fl_Task) {
-        Poco::DirectoryIterator *it = (Poco::DirectoryIterator *) lock->fl_Task;
+    if (READ_LONG_FIELD(lock, struct FileLock, fl_Task)) {
+        Poco::DirectoryIterator *it = (Poco::DirectoryIterator *) READ_LONG_FIELD(lock, struct FileLock, fl_Task);
         delete it;
     }
-    g_memmgr->free((uint8_t *) lock);
-    return 0;
+    m_lockPool.free(lock);
 }
 
 
@@ -507,18 +435,16 @@ uint32_t DOSLibrary::UnLock()
 // D2: pointer to struct FileInfoBlock
 // returns: > 0 or 0 in case of an error
 //
-uint32_t DOSLibrary::Examine()
+int32_t DOSLibrary::Examine(BcplPtr<D1> lock, GuestPtr<D2> fib)
 {
     LOG4CXX_DEBUG(g_logger, "DOSLibrary::Examine() has been called");
-    struct FileLock *lock = (struct FileLock *) PTR_M68K_TO_HOST(PTR_BCPL_TO_C(m68k_get_reg(NULL, M68K_REG_D1)));
-    struct FileInfoBlock *fib   = (struct FileInfoBlock *) PTR_M68K_TO_HOST(m68k_get_reg(NULL, M68K_REG_D2));
 
-    Poco::File *obj = (Poco::File *) lock->fl_Key;
+    Poco::File *obj = (Poco::File *) READ_LONG_FIELD(lock, struct FileLock, fl_Key);
     if (obj->isDirectory()) {
         // create DirectoryIterator object and store the pointer in fl_Task field of the lock. This of course breaks
         // programs which use this field to find out the handler that owns the lock...
         Poco::DirectoryIterator *it = new Poco::DirectoryIterator(*obj);
-        lock->fl_Task = (struct MsgPort *) it;
+        WRITE_LONG_FIELD(lock, struct FileLock, fl_Task, (uint32_t) it);
     }
 
     // fill FileInfoBlock with information of the current object
@@ -533,13 +459,11 @@ uint32_t DOSLibrary::Examine()
 // D2: pointer to struct FileInfoBlock
 // returns: > 0 or 0 in case of an error
 //
-uint32_t DOSLibrary::ExNext()
+int32_t DOSLibrary::ExNext(BcplPtr<D1> lock, GuestPtr<D2> fib)
 {
     LOG4CXX_DEBUG(g_logger, "DOSLibrary::ExNext() has been called");
-    struct FileLock *lock = (struct FileLock *) PTR_M68K_TO_HOST(PTR_BCPL_TO_C(m68k_get_reg(NULL, M68K_REG_D1)));
-    struct FileInfoBlock *fib = (struct FileInfoBlock *) PTR_M68K_TO_HOST(m68k_get_reg(NULL, M68K_REG_D2));
 
-    Poco::DirectoryIterator *it = (Poco::DirectoryIterator *) lock->fl_Task;
+    Poco::DirectoryIterator *it = (Poco::DirectoryIterator *) READ_LONG_FIELD(lock, struct FileLock, fl_Task);
 
     // check if there are more entries
     if (*it == Poco::DirectoryIterator()) {
@@ -570,29 +494,33 @@ uint32_t DOSLibrary::IoErr()
 
 //
 // Input
-// returns: BPTR to FileHandle structure
+// returns: BPTR to FileHandle structure (the same one for each call, like the input stream of a process)
 //
-uint32_t DOSLibrary::Input()
+BcplAddr DOSLibrary::Input()
 {
     LOG4CXX_DEBUG(g_logger, "DOSLibrary::Input() has been called");
-    struct FileHandle *fh = ((struct FileHandle *) g_memmgr->alloc(sizeof(struct FileHandle)));
-    // We store the address of the standard output stream in fh_Buf, so that Write() can refer to it.
-    fh->fh_Buf = (uint32_t) &std::cin;
-    return PTR_C_TO_BCPL(PTR_HOST_TO_M68K(fh));
+    if (m_input == 0) {
+        m_input = m_fhPool.alloc();
+        // We store the address of the standard input stream in fh_Buf.
+        WRITE_LONG_FIELD(m_input, struct FileHandle, fh_Buf, (uint32_t) &std::cin);
+    }
+    return {m_input};
 }
 
 
 //
 // Output
-// returns: BPTR to FileHandle structure
+// returns: BPTR to FileHandle structure (the same one for each call, like the output stream of a process)
 //
-uint32_t DOSLibrary::Output()
+BcplAddr DOSLibrary::Output()
 {
     LOG4CXX_DEBUG(g_logger, "DOSLibrary::Output() has been called");
-    struct FileHandle *fh = ((struct FileHandle *) g_memmgr->alloc(sizeof(struct FileHandle)));
-    // We store the address of the standard output stream in fh_Buf, so that Write() can refer to it.
-    fh->fh_Buf = (uint32_t) &std::cout;
-    return PTR_C_TO_BCPL(PTR_HOST_TO_M68K(fh));
+    if (m_output == 0) {
+        m_output = m_fhPool.alloc();
+        // We store the address of the standard output stream in fh_Buf, so that Write() can refer to it.
+        WRITE_LONG_FIELD(m_output, struct FileHandle, fh_Buf, (uint32_t) &std::cout);
+    }
+    return {m_output};
 }
 
 
@@ -603,22 +531,399 @@ uint32_t DOSLibrary::Output()
 // D3 size of buffer
 // returns: number of bytes written or -1 in case of an error
 //
-uint32_t DOSLibrary::Write()
+int32_t DOSLibrary::Write(BcplPtr<D1> fh, GuestPtr<D2> buffer, I32<D3> length)
 {
     LOG4CXX_DEBUG(g_logger, "DOSLibrary::Write() has been called");
-    struct FileHandle *fh = (struct FileHandle *) PTR_M68K_TO_HOST(PTR_BCPL_TO_C(m68k_get_reg(NULL, M68K_REG_D1)));
     // Write() actually supported writing arbitrary objects but C++ output streams only
     // support character streams, so we treat the buffer as a character buffer.
-    const char *buffer    = (const char *) PTR_M68K_TO_HOST(m68k_get_reg(NULL, M68K_REG_D2));
-    uint32_t buflen       = m68k_get_reg(NULL, M68K_REG_D3);
-    
-    std::ostream *os = (std::ostream *) fh->fh_Buf;
-    os->write(buffer, buflen);
+    std::vector <char> data(length);
+    copyFromGuest(data.data(), buffer, length);
+
+    std::ostream *os = (std::ostream *) READ_LONG_FIELD(fh, struct FileHandle, fh_Buf);
+    os->write(data.data(), length);
     os->flush();
     if (os->good()) {
-        return buflen;
+        return length;
     }
     else {
         return -1;
     }
 }
+
+
+//
+// AllocDosObject
+// D1: type of object (DOS_FILEHANDLE or DOS_FIB, the other types are not supported)
+// D2: tag list (not used)
+// returns: pointer to the object or 0 in case of an error
+//
+uint32_t DOSLibrary::AllocDosObject(U32<D1> type, GuestPtr<D2> tags)
+{
+    LOG4CXX_DEBUG(g_logger, "DOSLibrary::AllocDosObject() has been called");
+    LOG4CXX_DEBUG(g_logger, "type = " << type);
+
+    try {
+        uint32_t obj;
+        switch (type) {
+        case DOS_FILEHANDLE:
+            obj = m_fhPool.alloc();
+            WRITE_LONG_FIELD(obj, struct FileHandle, fh_Pos, 0xffffffff);
+            WRITE_LONG_FIELD(obj, struct FileHandle, fh_End, 0xffffffff);
+            return obj;
+        case DOS_FIB:
+            return m_fibPool.alloc();
+        default:
+            LOG4CXX_ERROR(g_logger, "objects of type " << type << " are not supported by AllocDosObject()");
+            m_errno = ERROR_BAD_NUMBER;
+            return 0;
+        }
+    }
+    catch (std::exception &e) {
+        m_errno = ERROR_NO_FREE_STORE;
+        return 0;
+    }
+}
+
+
+//
+// FreeDosObject
+// D1: type of object
+// D2: pointer to the object
+//
+void DOSLibrary::FreeDosObject(U32<D1> type, GuestPtr<D2> ptr)
+{
+    LOG4CXX_DEBUG(g_logger, "DOSLibrary::FreeDosObject() has been called");
+    LOG4CXX_DEBUG(g_logger, "type = " << type << Poco::format(", ptr = 0x%08x", (uint32_t) ptr));
+
+    if (ptr == 0)
+        return;
+    switch (type) {
+    case DOS_FILEHANDLE:
+        m_fhPool.free(ptr);
+        break;
+    case DOS_FIB:
+        m_fibPool.free(ptr);
+        break;
+    default:
+        LOG4CXX_ERROR(g_logger, "objects of type " << type << " are not supported by FreeDosObject()");
+    }
+}
+
+
+//
+// methods of UtilityLibrary
+//
+
+UtilityLibrary::UtilityLibrary(uint32_t base) : AmiLibrary("utility.library", 40, base)
+{
+    static const FUNC_BINDING bindings[] = {
+        BIND(UtilityLibrary, FindTagItem),
+        BIND(UtilityLibrary, GetTagData),
+        BIND(UtilityLibrary, NextTagItem),
+        BIND(UtilityLibrary, SMult32),
+        BIND(UtilityLibrary, UMult32),
+        BIND(UtilityLibrary, SDivMod32),
+        BIND(UtilityLibrary, UDivMod32),
+        BIND(UtilityLibrary, SMult64),
+        BIND(UtilityLibrary, UMult64)
+    };
+    static const LibraryImage image(UTILITY_LIB_LVOS, bindings);
+    setupJumpTable(base, image);
+}
+
+
+//
+// return the next item of a tag list that is not a system tag (TAG_DONE, TAG_MORE, ...) or 0 at the end of the list,
+// item is the address of the current item (in guest memory) and is advanced
+//
+uint32_t UtilityLibrary::nextTagItem(uint32_t &item)
+{
+    while (item) {
+        switch (READ_LONG_FIELD(item, struct TagItem, ti_Tag)) {
+            case TAG_DONE:
+                item = 0;
+                break;
+            case TAG_MORE:
+                item = READ_LONG_FIELD(item, struct TagItem, ti_Data);
+                break;
+            case TAG_IGNORE:
+                item += sizeof(struct TagItem);
+                break;
+            case TAG_SKIP:
+                item += (READ_LONG_FIELD(item, struct TagItem, ti_Data) + 1) * sizeof(struct TagItem);
+                break;
+            default:
+                item += sizeof(struct TagItem);
+                return item - sizeof(struct TagItem);
+        }
+    }
+    return 0;
+}
+
+
+//
+// FindTagItem
+// D0: tag to search for
+// A0: tag list (may be 0)
+// returns: pointer to the first item with this tag or 0
+//
+uint32_t UtilityLibrary::FindTagItem(U32<D0> tagVal, GuestPtr<A0> tagList)
+{
+    LOG4CXX_DEBUG(g_logger, "UtilityLibrary::FindTagItem() has been called");
+
+    uint32_t next = tagList, item;
+    while ((item = nextTagItem(next)) != 0) {
+        if (READ_LONG_FIELD(item, struct TagItem, ti_Tag) == tagVal)
+            return item;
+    }
+    return 0;
+}
+
+
+//
+// GetTagData
+// D0: tag to search for
+// D1: default value
+// A0: tag list (may be 0)
+// returns: data of the first item with this tag or the default value
+//
+uint32_t UtilityLibrary::GetTagData(U32<D0> tagValue, U32<D1> defaultVal, GuestPtr<A0> tagList)
+{
+    LOG4CXX_DEBUG(g_logger, "UtilityLibrary::GetTagData() has been called");
+    const uint32_t item = FindTagItem({tagValue}, {tagList});
+    return item ? READ_LONG_FIELD(item, struct TagItem, ti_Data) : defaultVal.value;
+}
+
+
+//
+// NextTagItem
+// A0: pointer to pointer to the current item of a tag list
+// returns: pointer to the next item that is not a system tag (TAG_DONE, TAG_MORE, ...) or 0 at the end of the list
+//
+uint32_t UtilityLibrary::NextTagItem(GuestPtr<A0> tagListPtr)
+{
+    LOG4CXX_DEBUG(g_logger, "UtilityLibrary::NextTagItem() has been called");
+    uint32_t next = READ_LONG(g_mem, tagListPtr);
+    const uint32_t item = nextTagItem(next);
+    WRITE_LONG(g_mem, tagListPtr, next);
+    return item;
+}
+
+
+int32_t UtilityLibrary::SMult32(I32<D0> arg1, I32<D1> arg2)
+{
+    return (int32_t) ((uint32_t) arg1.value * (uint32_t) arg2.value);
+}
+
+
+uint32_t UtilityLibrary::UMult32(U32<D0> arg1, U32<D1> arg2)
+{
+    return arg1 * arg2;
+}
+
+
+//
+// SDivMod32
+// D0: dividend
+// D1: divisor
+// returns: quotient in D0, remainder (with the sign of the dividend) in D1
+//
+RegPair UtilityLibrary::SDivMod32(I32<D0> dividend, I32<D1> divisor)
+{
+    if (divisor == 0) {
+        LOG4CXX_ERROR(g_logger, "SDivMod32() called with divisor 0");
+        throw std::runtime_error("division by zero");
+    }
+    // The only quotient that doesn't fit into 32 bits wraps around like on the M68K.
+    if ((dividend == INT32_MIN) && (divisor == -1))
+        return {(uint32_t) INT32_MIN, 0};
+    return {(uint32_t) (dividend / divisor), (uint32_t) (dividend % divisor)};
+}
+
+
+//
+// UDivMod32
+// D0: dividend
+// D1: divisor
+// returns: quotient in D0, remainder in D1
+//
+RegPair UtilityLibrary::UDivMod32(U32<D0> dividend, U32<D1> divisor)
+{
+    if (divisor == 0) {
+        LOG4CXX_ERROR(g_logger, "UDivMod32() called with divisor 0");
+        throw std::runtime_error("division by zero");
+    }
+    return {dividend / divisor, dividend % divisor};
+}
+
+
+//
+// SMult64 / UMult64
+// D0, D1: factors
+// returns: 64-bit product, high longword in D0 and low longword in D1
+//
+RegPair UtilityLibrary::SMult64(I32<D0> arg1, I32<D1> arg2)
+{
+    const uint64_t product = (uint64_t) ((int64_t) arg1 * (int64_t) arg2);
+    return {(uint32_t) (product >> 32), (uint32_t) product};
+}
+
+
+RegPair UtilityLibrary::UMult64(U32<D0> arg1, U32<D1> arg2)
+{
+    const uint64_t product = (uint64_t) arg1 * (uint64_t) arg2;
+    return {(uint32_t) (product >> 32), (uint32_t) product};
+}
+
+
+//
+// methods of PluginLibrary
+//
+
+// services for the plugins
+static uint32_t pluginGetReg(int reg)
+{
+    return m68k_get_reg(NULL, (m68k_register_t) reg);
+}
+
+static void pluginSetReg(int reg, uint32_t value)
+{
+    m68k_set_reg((m68k_register_t) reg, value);
+}
+
+static uint32_t pluginAlloc(uint32_t size)
+{
+    try {
+        return PTR_HOST_TO_M68K(g_memmgr->alloc(size));
+    }
+    catch (std::exception &e) {
+        return 0;
+    }
+}
+
+static void pluginFree(uint32_t address)
+{
+    g_memmgr->free(PTR_M68K_TO_HOST(address));
+}
+
+static void pluginLog(int level, const char *msg)
+{
+    switch (level) {
+        case VADM_LOG_DEBUG: LOG4CXX_DEBUG(g_logger, msg); break;
+        case VADM_LOG_INFO:  LOG4CXX_INFO(g_logger, msg); break;
+        case VADM_LOG_WARN:  LOG4CXX_WARN(g_logger, msg); break;
+        default:             LOG4CXX_ERROR(g_logger, msg); break;
+    }
+}
+
+static const VADM_SERVICES s_services = {
+    pluginGetReg, pluginSetReg,
+    m68k_read_8, m68k_read_16, m68k_read_32, m68k_write_8, m68k_write_16, m68k_write_32,
+    copyToGuest, copyFromGuest,
+    pluginAlloc, pluginFree,
+    pluginLog
+};
+
+// registers of the routines of plugins (for the check of the binding)
+static size_t noRegs(const uint8_t **regs)
+{
+    static const uint8_t r[] = {0xff};
+    *regs = r;
+    return 0;
+}
+
+static_assert((VADM_REG_D0 == M68K_REG_D0) && (VADM_REG_A7 == M68K_REG_A7), "register numbers of plugin interface don't match Musashi");
+
+
+//
+// load the plugin for the library with the specified name, returns nullptr if there is no (usable) plugin
+//
+PluginLibrary *PluginLibrary::create(const std::string &name, const uint32_t base)
+{
+#ifdef __APPLE__
+    const std::string path = Poco::Path(Poco::Path(g_pluginDir).makeDirectory(), name + ".dylib").toString();
+#else
+    const std::string path = Poco::Path(Poco::Path(g_pluginDir).makeDirectory(), name + ".so").toString();
+#endif
+    if (!Poco::File(path).exists())
+        return nullptr;
+
+    LOG4CXX_INFO(g_logger, "loading plugin " << path);
+    Poco::SharedLibrary *shlib;
+    try {
+        shlib = new Poco::SharedLibrary(path);
+    }
+    catch (std::exception &e) {
+        LOG4CXX_ERROR(g_logger, "could not load plugin " << path << ": " << e.what());
+        return nullptr;
+    }
+
+    const VADM_PLUGIN *plugin = nullptr;
+    if (shlib->hasSymbol(VADM_PLUGIN_INIT_NAME))
+        plugin = ((VADM_PLUGIN_INIT) shlib->getSymbol(VADM_PLUGIN_INIT_NAME))(&s_services);
+    if ((plugin == nullptr) || (plugin->pl_abiVersion != VADM_PLUGIN_ABI_VERSION) || (name != plugin->pl_name)) {
+        LOG4CXX_ERROR(g_logger, "plugin " << path << " is not a VADM plugin for " << name << " (or has the wrong version)");
+        shlib->unload();
+        delete shlib;
+        return nullptr;
+    }
+
+    // The offsets must be multiples of 6 behind the standard vectors (Open, Close, Expunge and the reserved one),
+    // each one used only once, otherwise the entries in the jump table would overlap.
+    std::vector<bool> used(0x10000 / 6 + 1, false);
+    for (uint32_t i = 0; i < plugin->pl_numFuncs; ++i) {
+        const uint16_t offset = plugin->pl_funcs[i].pf_offset;
+        if ((offset < 30) || (offset % 6 != 0) || used[offset / 6]) {
+            LOG4CXX_ERROR(g_logger, "plugin " << path << " has an invalid or duplicate offset " << offset << " for routine " << plugin->pl_funcs[i].pf_name);
+            shlib->unload();
+            delete shlib;
+            return nullptr;
+        }
+        used[offset / 6] = true;
+    }
+
+    if (plugin->pl_open && !plugin->pl_open()) {
+        LOG4CXX_ERROR(g_logger, "plugin " << path << " could not be initialized");
+        shlib->unload();
+        delete shlib;
+        return nullptr;
+    }
+    return new PluginLibrary(shlib, plugin, base);
+}
+
+
+PluginLibrary::PluginLibrary(Poco::SharedLibrary *shlib, const VADM_PLUGIN *plugin, const uint32_t base)
+    : AmiLibrary(plugin->pl_name, plugin->pl_version, base), m_shlib(shlib), m_plugin(plugin)
+{
+    // All routines of the plugin go through callPlugin(), which finds the native function by the offset. The
+    // arguments are fetched by the native functions themselves, so there are no registers to check.
+    std::vector <LVO_ENTRY> lvos;
+    std::vector <FUNC_BINDING> bindings;
+    for (uint32_t i = 0; i < plugin->pl_numFuncs; ++i) {
+        const VADM_PLUGIN_FUNCTION *func = &plugin->pl_funcs[i];
+        lvos.push_back({func->pf_name, func->pf_offset, true, 0, {}});
+        bindings.push_back({func->pf_name, &PluginLibrary::callPlugin, noRegs});
+        if (func->pf_offset / 6 >= m_funcs.size())
+            m_funcs.resize(func->pf_offset / 6 + 1, nullptr);
+        m_funcs[func->pf_offset / 6] = func->pf_func;
+    }
+    m_ownImage.reset(new LibraryImage(lvos.data(), lvos.size(), bindings.data(), bindings.size()));
+    setupJumpTable(base, *m_ownImage);
+}
+
+
+PluginLibrary::~PluginLibrary()
+{
+    if (m_plugin->pl_close)
+        m_plugin->pl_close();
+    m_shlib->unload();
+}
+
+
+// thunk for all routines of a plugin
+void PluginLibrary::callPlugin(AmiLibrary *lib)
+{
+    // The PC still points to the extension word of the line A opcode, which contains the offset.
+    const uint16_t offset = m68k_read_16(m68k_get_reg(NULL, M68K_REG_PC));
+    m68k_set_reg(M68K_REG_D0, static_cast<PluginLibrary *>(lib)->m_funcs[offset / 6]());
+}
@@ -6,6 +6,8 @@
 
 
 #include <iostream>
+#include <vector>
+#include <memory>
 #include <stdint.h>
 #include <log4cxx/logger.h>
 #include <Poco/Format.h>
@@ -14,8 +16,11 @@
 #include <Poco/DirectoryIterator.h>
 #include <Poco/DateTime.h>
 #include <Poco/DateTimeParser.h>
+#include <Poco/SharedLibrary.h>
 
 #include "memory.h"
+#include "binding.h"
+#include "vadmplugin.h"
 
 extern "C"
 {
@@ -27,6 +32,7 @@ extern "C"
 #define _SYS_TIME_H_
 #include <exec/memory.h>
 #include <dos/dosextens.h>
+#include <utility/tagitem.h>
 }
 
 
@@ -35,9 +41,12 @@ extern "C"
 
 
 #define ADDR_EXEC_BASE   0x00f00000
-#define ADDR_DOS_BASE    0x00f10000
 
-#define SWAP_BYTES(x) (((x) & 0x000000ff) << 24) | (((x) & 0x0000ff00) << 8) | (((x) & 0x00ff0000) >> 8) | (((x) & 0xff000000) >> 24)
+// Each library occupies a slot of 64k (its jump table is at the end of the previous slot). The slots are assigned
+// when the libraries are opened, Exec is always in slot 0.
+#define LIB_BASE_TO_SLOT(BASE) (((BASE) - ADDR_EXEC_BASE) >> 16)
+#define LIB_SLOT_TO_BASE(SLOT) (ADDR_EXEC_BASE + ((SLOT) << 16))
+#define LIB_MAX_SLOTS          16
 
 
 // global logger
@@ -49,24 +58,69 @@ extern uint8_t *g_mem;
 // global pointer to MemoryManager object
 extern MemoryManager *g_memmgr;
 
-// global map of opened libraries
+// global table of opened libraries (indexed by slot)
 class AmiLibrary;
-extern std::map <uint32_t, AmiLibrary *> g_libmap;
+extern AmiLibrary *g_libtab[LIB_MAX_SLOTS];
+
+// directory where the plugins (libraries implemented in shared objects) are searched
+extern std::string g_pluginDir;
 
 
 std::string hexdump(const uint8_t *, size_t);
 
 
+// entry in the tables of library routines generated by genlvo.pl from the .fd files of the NDK (lvotables.h)
+#define LVO_MAX_ARGS 14
+typedef struct
+{
+    const char *lvo_name;
+    uint16_t   lvo_offset;
+    bool       lvo_public;
+    uint8_t    lvo_nargs;
+    uint8_t    lvo_regs[LVO_MAX_ARGS];      // registers of the arguments (m68k_register_t)
+} LVO_ENTRY;
+
+
 class AmiLibrary
 {
 public:
+    AmiLibrary(const std::string &name, const uint16_t version, const uint32_t base)
+        : m_name(name), m_version(version), m_base(base) {}
+    virtual ~AmiLibrary();
+
     void call(const uint16_t offset);
 
-protected:
-    typedef uint32_t (AmiLibrary::*FUNCPTR)();
+    const std::string &getName() const { return m_name; }
+    uint16_t getVersion() const { return m_version; }
+    uint32_t getBase() const { return m_base; }
 
-    std::map <const uint16_t, FUNCPTR> m_funcmap;
+    // open count maintained by OpenLibrary() / CloseLibrary()
+    uint32_t m_openCount = 0;
 
+protected:
+    // Everything that is the same for all instances of a library: the table of routines indexed by offset / 6 and
+    // the image of the jump table (in the byte order of the M68K, starting at base - size of jump table). It is
+    // built once from the generated table of routines and the bindings.
+    class LibraryImage
+    {
+    public:
+        template <size_t NLVOS, size_t NBINDINGS>
+        LibraryImage(const LVO_ENTRY (&lvos)[NLVOS], const FUNC_BINDING (&bindings)[NBINDINGS])
+            : LibraryImage(lvos, NLVOS, bindings, NBINDINGS) {}
+        LibraryImage(const LVO_ENTRY *lvos, size_t nlvos, const FUNC_BINDING *bindings, size_t nbindings);
+
+        std::vector <THUNK> m_functab;
+        std::vector <uint8_t> m_jumptab;
+    };
+
+    const std::string  m_name;
+    const uint16_t     m_version;
+    const uint32_t     m_base;
+    const LibraryImage *m_image = nullptr;
+    uint32_t           m_jumptabSize = 0;
+
+    void setupJumpTable(const uint32_t base, const LibraryImage &image);
+    static void notImplemented(AmiLibrary *lib);
 };
 
 
@@ -77,9 +131,12 @@ public:
 
 private:
 
-    uint32_t OpenLibrary();
-    uint32_t AllocVec();
-    uint32_t FreeVec();
+    uint32_t OpenLibrary(GuestStr<A1> libname, U32<D0> version);
+    void CloseLibrary(GuestPtr<A1> library);
+    void CopyMem(GuestPtr<A0> source, GuestPtr<A1> dest, U32<D0> size);
+    void CopyMemQuick(GuestPtr<A0> source, GuestPtr<A1> dest, U32<D0> size);
+    uint32_t AllocVec(U32<D0> size, U32<D1> flags);
+    void FreeVec(GuestPtr<A1> ptr);
 };
 
 
@@ -87,21 +144,139 @@ class DOSLibrary : public AmiLibrary
 {
 public:
     DOSLibrary(uint32_t base);
+    ~DOSLibrary();
 
 private:
     uint32_t m_errno;
+    SlabPool m_lockPool;
+    SlabPool m_fhPool;
+    SlabPool m_fibPool;
+    uint32_t m_input;                               // file handles for the standard streams, created on first use
+    uint32_t m_output;
 
-    void getFileInfo(const Poco::File &obj, struct FileInfoBlock *);
+    void getFileInfo(const Poco::File &obj, const uint32_t fib);
 
-    uint32_t PutStr();
+    int32_t PutStr(GuestStr<D1> str);
     uint32_t IoErr();
-    uint32_t Lock();
-    uint32_t UnLock();
-    uint32_t Examine();
-    uint32_t ExNext();
-    uint32_t Input();
-    uint32_t Output();
-    uint32_t Write();
+    BcplAddr Lock(GuestStr<D1> path, I32<D2> mode);
+    void UnLock(BcplPtr<D1> lock);
+    int32_t Examine(BcplPtr<D1> lock, GuestPtr<D2> fib);
+    int32_t ExNext(BcplPtr<D1> lock, GuestPtr<D2> fib);
+    BcplAddr Input();
+    BcplAddr Output();
+    int32_t Write(BcplPtr<D1> fh, GuestPtr<D2> buffer, I32<D3> length);
+    uint32_t AllocDosObject(U32<D1> type, GuestPtr<D2> tags);
+    void FreeDosObject(U32<D1> type, GuestPtr<D2> ptr);
+};
+
+
+class UtilityLibrary : public AmiLibrary
+{
+public:
+    UtilityLibrary(uint32_t base);
+
+private:
+    uint32_t nextTagItem(uint32_t &item);
+
+    uint32_t FindTagItem(U32<D0> tagVal, GuestPtr<A0> tagList);
+    uint32_t GetTagData(U32<D0> tagValue, U32<D1> defaultVal, GuestPtr<A0> tagList);
+    uint32_t NextTagItem(GuestPtr<A0> tagListPtr);
+    int32_t SMult32(I32<D0> arg1, I32<D1> arg2);
+    uint32_t UMult32(U32<D0> arg1, U32<D1> arg2);
+    RegPair SDivMod32(I32<D0> dividend, I32<D1> divisor);
+    RegPair UDivMod32(U32<D0> dividend, U32<D1> divisor);
+    RegPair SMult64(I32<D0> arg1, I32<D1> arg2);
+    RegPair UMult64(U32<D0> arg1, U32<D1> arg2);
+};
+
+
+// IEEE double precision basic math, computed by the FPU of the host
+class MathIeeeDoubBasLibrary : public AmiLibrary
+{
+public:
+    MathIeeeDoubBasLibrary(uint32_t base);
+
+private:
+    int32_t IEEEDPFix(Double<D0, D1> parm);
+    DoubleVal IEEEDPFlt(I32<D0> integer);
+    int32_t IEEEDPCmp(Double<D0, D1> leftParm, Double<D2, D3> rightParm);
+    int32_t IEEEDPTst(Double<D0, D1> parm);
+    DoubleVal IEEEDPAbs(Double<D0, D1> parm);
+    DoubleVal IEEEDPNeg(Double<D0, D1> parm);
+    DoubleVal IEEEDPAdd(Double<D0, D1> leftParm, Double<D2, D3> rightParm);
+    DoubleVal IEEEDPSub(Double<D0, D1> leftParm, Double<D2, D3> rightParm);
+    DoubleVal IEEEDPMul(Double<D0, D1> factor1, Double<D2, D3> factor2);
+    DoubleVal IEEEDPDiv(Double<D0, D1> dividend, Double<D2, D3> divisor);
+    DoubleVal IEEEDPFloor(Double<D0, D1> parm);
+    DoubleVal IEEEDPCeil(Double<D0, D1> parm);
+};
+
+
+// IEEE double precision transcendental math, computed by the math library of the host
+class MathIeeeDoubTransLibrary : public AmiLibrary
+{
+public:
+    MathIeeeDoubTransLibrary(uint32_t base);
+
+private:
+    DoubleVal IEEEDPAtan(Double<D0, D1> parm);
+    DoubleVal IEEEDPSin(Double<D0, D1> parm);
+    DoubleVal IEEEDPCos(Double<D0, D1> parm);
+    DoubleVal IEEEDPTan(Double<D0, D1> parm);
+    DoubleVal IEEEDPSincos(GuestPtr<A0> pf2, Double<D0, D1> parm);
+    DoubleVal IEEEDPSinh(Double<D0, D1> parm);
+    DoubleVal IEEEDPCosh(Double<D0, D1> parm);
+    DoubleVal IEEEDPTanh(Double<D0, D1> parm);
+    DoubleVal IEEEDPExp(Double<D0, D1> parm);
+    DoubleVal IEEEDPLog(Double<D0, D1> parm);
+    DoubleVal IEEEDPPow(Double<D2, D3> exp, Double<D0, D1> arg);
+    DoubleVal IEEEDPSqrt(Double<D0, D1> parm);
+    uint32_t IEEEDPTieee(Double<D0, D1> parm);
+    DoubleVal IEEEDPFieee(U32<D0> single);
+    DoubleVal IEEEDPAsin(Double<D0, D1> parm);
+    DoubleVal IEEEDPAcos(Double<D0, D1> parm);
+    DoubleVal IEEEDPLog10(Double<D0, D1> parm);
+};
+
+
+// Motorola fast floating point basic math, computed by the FPU of the host
+class MathFFPLibrary : public AmiLibrary
+{
+public:
+    MathFFPLibrary(uint32_t base);
+
+private:
+    int32_t SPFix(Ffp<D0> parm);
+    FfpVal SPFlt(I32<D0> integer);
+    int32_t SPCmp(Ffp<D1> leftParm, Ffp<D0> rightParm);
+    int32_t SPTst(Ffp<D1> parm);
+    FfpVal SPAbs(Ffp<D0> parm);
+    FfpVal SPNeg(Ffp<D0> parm);
+    FfpVal SPAdd(Ffp<D1> leftParm, Ffp<D0> rightParm);
+    FfpVal SPSub(Ffp<D1> leftParm, Ffp<D0> rightParm);
+    FfpVal SPMul(Ffp<D1> leftParm, Ffp<D0> rightParm);
+    FfpVal SPDiv(Ffp<D1> leftParm, Ffp<D0> rightParm);
+    FfpVal SPFloor(Ffp<D0> parm);
+    FfpVal SPCeil(Ffp<D0> parm);
+};
+
+
+// library implemented in a shared object (see vadmplugin.h)
+class PluginLibrary : public AmiLibrary
+{
+public:
+    static PluginLibrary *create(const std::string &name, const uint32_t base);
+    virtual ~PluginLibrary();
+
+private:
+    PluginLibrary(Poco::SharedLibrary *shlib, const VADM_PLUGIN *plugin, const uint32_t base);
+
+    std::unique_ptr <Poco::SharedLibrary> m_shlib;
+    const VADM_PLUGIN *m_plugin;
+    std::vector <uint32_t (*)(void)> m_funcs;           // indexed by offset / 6
+    std::unique_ptr <LibraryImage> m_ownImage;
+
+    static void callPlugin(AmiLibrary *lib);
 };
 
 
@@ -15,7 +15,33 @@ extern log4cxx::LoggerPtr g_logger;
 extern uint8_t *g_mem;
 
 
-void AmiHunkLoader::load(char *fname, uint32_t loc)
+//
+// read a block of code or data from the executable into memory at address loc
+//
+void AmiHunkLoader::readBlock(Poco::BinaryReader &reader, const uint32_t loc, const uint32_t nbytes)
+{
+    std::vector <char> buffer(nbytes);
+    reader.readRaw(buffer.data(), nbytes);
+    LOG4CXX_TRACE(g_logger, "hex dump of block:\n" << hexdump((const uint8_t *) buffer.data(), nbytes));
+    copyToGuest(loc, buffer.data(), nbytes);
+}
+
+
+//
+// skip a block of the executable that is not needed
+//
+void AmiHunkLoader::skipBlock(Poco::BinaryReader &reader, const uint32_t nbytes)
+{
+    std::vector <char> buffer(nbytes);
+    reader.readRaw(buffer.data(), nbytes);
+}
+
+
+//
+// load the executable fname at address loc
+// returns: number of bytes occupied by the hunks of the program
+//
+uint32_t AmiHunkLoader::load(char *fname, uint32_t loc)
 {
     Poco::FileInputStream exe(fname);
     Poco::BinaryReader::BinaryReader reader(exe, Poco::BinaryReader::BIG_ENDIAN_BYTE_ORDER);
@@ -56,8 +82,7 @@ void AmiHunkLoader::load(char *fname, uint32_t loc)
                 uint32_t nwords;
                 reader >> nwords;
                 LOG4CXX_DEBUG(g_logger, "size (in bytes) of code block: " << nwords * 4);
-                reader.readRaw((char *) g_mem + hlocs[hnum], nwords * 4);
-                LOG4CXX_TRACE(g_logger, "hex dump of block:\n" << hexdump(g_mem + hlocs[hnum], nwords * 4));
+                readBlock(reader, hlocs[hnum], nwords * 4);
                 break;
 
             case HUNK_DATA:
@@ -66,14 +91,14 @@ void AmiHunkLoader::load(char *fname, uint32_t loc)
                 LOG4CXX_DEBUG(g_logger, "size (in bytes) of data block: " << nwords * 4);
                 // Both the AmigaDOS manual and the Amiga Guru book state that after the length word only the data itself and nothing else follows,
                 // but it seems in executables the data is always followed by a null word...
-                reader.readRaw((char *) g_mem + hlocs[hnum], (nwords + 1) * 4);
-                LOG4CXX_TRACE(g_logger, "hex dump of block:\n" << hexdump(g_mem + hlocs[hnum], nwords * 4));
+                readBlock(reader, hlocs[hnum], (nwords + 1) * 4);
                 break;
 
             case HUNK_BSS:
                 LOG4CXX_INFO(g_logger, "hunk #" << hnum << ", block type = HUNK_BSS");
                 reader >> nwords;
                 LOG4CXX_DEBUG(g_logger, "size (in bytes) of BSS block: " << nwords * 4);
+                fillGuest(hlocs[hnum], 0, nwords * 4);
                 break;
 
             case HUNK_RELOC32:
@@ -91,19 +116,45 @@ void AmiHunkLoader::load(char *fname, uint32_t loc)
                         throw std::runtime_error ("bad executable");
                     }
 
+                    // The relocations are applied directly in the memory (the hunk has just been copied there, so it is
+                    // neither protected nor cached yet).
                     uint32_t  offset;
                     for (int i = 0; i < noffsets; i++) {
                         reader >> offset;
                         LOG4CXX_TRACE(g_logger, "applying reloc referring to hunk #" << refhnum << ", offset = " << offset);
-                        m68k_write_32(hlocs[hnum] + offset, m68k_read_32(hlocs[hnum] + offset) + hlocs[refhnum]);
+                        const uint32_t addr = hlocs[hnum] + offset;
+                        checkGuestRange(addr, 4);
+                        const uint32_t value = READ_LONG(g_mem, addr) + hlocs[refhnum];
+                        WRITE_LONG(g_mem, addr, value);
                     }
                 }
                 break;
 
             case HUNK_SYMBOL:
                 LOG4CXX_INFO(g_logger, "hunk #" << hnum << ", block type = HUNK_SYMBOL");
-                LOG4CXX_ERROR(g_logger, "block type is not implemented");
-                throw std::runtime_error ("block type not implemented");
+                // list of symbols, each consisting of the length of the name in long words, the name (padded with
+                // NUL bytes) and the offset in the hunk, terminated by a length of 0
+                while (true) {
+                    uint32_t nlongs;
+                    reader >> nlongs;
+                    if (nlongs == 0)
+                        break;
+
+                    std::string name;
+                    reader.readRaw(nlongs * 4, name);
+                    name.resize(strnlen(name.c_str(), nlongs * 4));
+                    uint32_t offset;
+                    reader >> offset;
+                    LOG4CXX_DEBUG(g_logger, "symbol " << name << Poco::format(" at 0x%08x", hlocs[hnum] + offset));
+                    m_symbols[name] = hlocs[hnum] + offset;
+                }
+                break;
+
+            case HUNK_DEBUG:
+                LOG4CXX_INFO(g_logger, "hunk #" << hnum << ", block type = HUNK_DEBUG");
+                reader >> nwords;
+                LOG4CXX_DEBUG(g_logger, "skipping " << nwords * 4 << " bytes of debug information");
+                skipBlock(reader, nwords * 4);
                 break;
 
             case HUNK_END:
@@ -115,5 +166,6 @@ void AmiHunkLoader::load(char *fname, uint32_t loc)
                 LOG4CXX_ERROR(g_logger, "unknown block type: " << btype);
         }
     }
+    return hloc - loc;
 }
 
@@ -6,10 +6,14 @@
 
 
 #include <stdint.h>
+#include <vector>
+#include <map>
+#include <string>
 #include <log4cxx/logger.h>
 #include <Poco/Format.h>
 #include <Poco/FileStream.h>
 #include <Poco/BinaryReader.h>
+#include "memory.h"
 
 extern "C"
 {
@@ -22,17 +26,21 @@ extern "C"
 
 
 std::string hexdump(const uint8_t *, size_t);
-extern "C"
-{
-unsigned int m68k_read_32(unsigned int address);
-void m68k_write_32(unsigned int address, unsigned int value);
-}
 
 
 class AmiHunkLoader
 {
 public:
-    void load(char *fname, uint32_t loc);
+    uint32_t load(char *fname, uint32_t loc);
+
+    // symbols found in HUNK_SYMBOL blocks (name => address)
+    const std::map <std::string, uint32_t> &getSymbols() const { return m_symbols; }
+
+private:
+    std::map <std::string, uint32_t> m_symbols;
+
+    void readBlock(Poco::BinaryReader &reader, const uint32_t loc, const uint32_t nbytes);
+    void skipBlock(Poco::BinaryReader &reader, const uint32_t nbytes);
 };
 
 
@@ -0,0 +1,413 @@
+//
+// VADM - math libraries (IEEE double precision and Motorola fast floating point) implemented natively
+//
+// Programs compiled for a plain 68000 do all floating point calculations either in software (thousands of
+// instructions per multiplication) or by calling these libraries. We compute the results with the FPU / math
+// library of the host instead. The numbers are converted from / to the registers by the argument and result types
+// in binding.h.
+//
+// Copyright(C) 2017 Constantin Wiemer
+//
+
+
+#include <limits.h>
+#include "libs.h"
+#include "lvotables.h"
+
+
+// Set the condition codes like the original routines do for comparisons and tests (N and Z reflect the result,
+// V and C are cleared), so programs can branch on them without testing D0 again.
+static int32_t setConditionCodes(const int32_t result)
+{
+    uint32_t sr = m68k_get_reg(NULL, M68K_REG_SR) & ~0x000f;
+    if (result < 0)
+        sr |= 0x0008;
+    else if (result == 0)
+        sr |= 0x0004;
+    m68k_set_reg(M68K_REG_SR, sr);
+    return result;
+}
+
+
+static int32_t compare(const double left, const double right)
+{
+    return setConditionCodes((left > right) ? 1 : ((left < right) ? -1 : 0));
+}
+
+
+// conversion to integer (truncated towards zero and clipped to the range of a 32-bit integer like on the Amiga)
+static int32_t fix(const double value)
+{
+    if (value >= INT32_MAX)
+        return INT32_MAX;
+    if (value <= INT32_MIN)
+        return INT32_MIN;
+    if (value != value)
+        return 0;                                   // NaN
+    return (int32_t) value;
+}
+
+
+//
+// methods of MathIeeeDoubBasLibrary
+//
+
+MathIeeeDoubBasLibrary::MathIeeeDoubBasLibrary(uint32_t base) : AmiLibrary("mathieeedoubbas.library", 40, base)
+{
+    static const FUNC_BINDING bindings[] = {
+        BIND(MathIeeeDoubBasLibrary, IEEEDPFix),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPFlt),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPCmp),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPTst),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPAbs),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPNeg),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPAdd),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPSub),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPMul),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPDiv),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPFloor),
+        BIND(MathIeeeDoubBasLibrary, IEEEDPCeil)
+    };
+    static const LibraryImage image(MATHIEEEDOUBBAS_LIB_LVOS, bindings);
+    setupJumpTable(base, image);
+}
+
+
+int32_t MathIeeeDoubBasLibrary::IEEEDPFix(Double<D0, D1> parm)
+{
+    return fix(parm);
+}
+
+
+DoubleVal MathIeeeDoubBasLibrary::IEEEDPFlt(I32<D0> integer)
+{
+    return {(double) integer};
+}
+
+
+//
+// IEEEDPCmp
+// D0/D1: left operand
+// D2/D3: right operand
+// returns: 1 if left > right, -1 if left < right, 0 if both are equal (condition codes are set accordingly)
+//
+int32_t MathIeeeDoubBasLibrary::IEEEDPCmp(Double<D0, D1> leftParm, Double<D2, D3> rightParm)
+{
+    return compare(leftParm, rightParm);
+}
+
+
+int32_t MathIeeeDoubBasLibrary::IEEEDPTst(Double<D0, D1> parm)
+{
+    return compare(parm, 0.0);
+}
+
+
+DoubleVal MathIeeeDoubBasLibrary::IEEEDPAbs(Double<D0, D1> parm)
+{
+    return {fabs(parm)};
+}
+
+
+DoubleVal MathIeeeDoubBasLibrary::IEEEDPNeg(Double<D0, D1> parm)
+{
+    return {-parm.value};
+}
+
+
+DoubleVal MathIeeeDoubBasLibrary::IEEEDPAdd(Double<D0, D1> leftParm, Double<D2, D3> rightParm)
+{
+    return {leftParm + rightParm};
+}
+
+
+DoubleVal MathIeeeDoubBasLibrary::IEEEDPSub(Double<D0, D1> leftParm, Double<D2, D3> rightParm)
+{
+    return {leftParm - rightParm};
+}
+
+
+DoubleVal MathIeeeDoubBasLibrary::IEEEDPMul(Double<D0, D1> factor1, Double<D2, D3> factor2)
+{
+    return {factor1 * factor2};
+}
+
+
+DoubleVal MathIeeeDoubBasLibrary::IEEEDPDiv(Double<D0, D1> dividend, Double<D2, D3> divisor)
+{
+    return {dividend / divisor};
+}
+
+
+DoubleVal MathIeeeDoubBasLibrary::IEEEDPFloor(Double<D0, D1> parm)
+{
+    return {floor(parm)};
+}
+
+
+DoubleVal MathIeeeDoubBasLibrary::IEEEDPCeil(Double<D0, D1> parm)
+{
+    return {ceil(parm)};
+}
+
+
+//
+// methods of MathIeeeDoubTransLibrary
+//
+
+MathIeeeDoubTransLibrary::MathIeeeDoubTransLibrary(uint32_t base) : AmiLibrary("mathieeedoubtrans.library", 40, base)
+{
+    static const FUNC_BINDING bindings[] = {
+        BIND(MathIeeeDoubTransLibrary, IEEEDPAtan),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPSin),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPCos),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPTan),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPSincos),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPSinh),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPCosh),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPTanh),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPExp),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPLog),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPPow),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPSqrt),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPTieee),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPFieee),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPAsin),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPAcos),
+        BIND(MathIeeeDoubTransLibrary, IEEEDPLog10)
+    };
+    static const LibraryImage image(MATHIEEEDOUBTRANS_LIB_LVOS, bindings);
+    setupJumpTable(base, image);
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPAtan(Double<D0, D1> parm)
+{
+    return {atan(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPSin(Double<D0, D1> parm)
+{
+    return {sin(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPCos(Double<D0, D1> parm)
+{
+    return {cos(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPTan(Double<D0, D1> parm)
+{
+    return {tan(parm)};
+}
+
+
+//
+// IEEEDPSincos
+// A0: pointer to double that receives the cosine
+// D0/D1: argument
+// returns: sine
+//
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPSincos(GuestPtr<A0> pf2, Double<D0, D1> parm)
+{
+    const double c = cos(parm);
+    uint64_t bits;
+    memcpy(&bits, &c, sizeof(bits));
+    m68k_write_32(pf2, (uint32_t) (bits >> 32));
+    m68k_write_32(pf2 + 4, (uint32_t) bits);
+    return {sin(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPSinh(Double<D0, D1> parm)
+{
+    return {sinh(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPCosh(Double<D0, D1> parm)
+{
+    return {cosh(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPTanh(Double<D0, D1> parm)
+{
+    return {tanh(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPExp(Double<D0, D1> parm)
+{
+    return {exp(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPLog(Double<D0, D1> parm)
+{
+    return {log(parm)};
+}
+
+
+//
+// IEEEDPPow
+// D2/D3: exponent
+// D0/D1: base
+// returns: base ^ exponent
+//
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPPow(Double<D2, D3> exp, Double<D0, D1> arg)
+{
+    return {pow(arg, exp)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPSqrt(Double<D0, D1> parm)
+{
+    return {sqrt(parm)};
+}
+
+
+// conversion to IEEE single precision
+uint32_t MathIeeeDoubTransLibrary::IEEEDPTieee(Double<D0, D1> parm)
+{
+    const float single = (float) parm;
+    uint32_t bits;
+    memcpy(&bits, &single, sizeof(bits));
+    return bits;
+}
+
+
+// conversion from IEEE single precision
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPFieee(U32<D0> single)
+{
+    float value;
+    memcpy(&value, &single.value, sizeof(value));
+    return {value};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPAsin(Double<D0, D1> parm)
+{
+    return {asin(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPAcos(Double<D0, D1> parm)
+{
+    return {acos(parm)};
+}
+
+
+DoubleVal MathIeeeDoubTransLibrary::IEEEDPLog10(Double<D0, D1> parm)
+{
+    return {log10(parm)};
+}
+
+
+//
+// methods of MathFFPLibrary
+//
+// The routines work like the instructions of the M68K, i. e. the second operand (D0) is the destination. So SPSub()
+// and SPDiv() return D0 - D1 and D0 / D1 respectively and SPCmp() compares D0 with D1.
+//
+
+MathFFPLibrary::MathFFPLibrary(uint32_t base) : AmiLibrary("mathffp.library", 40, base)
+{
+    static const FUNC_BINDING bindings[] = {
+        BIND(MathFFPLibrary, SPFix),
+        BIND(MathFFPLibrary, SPFlt),
+        BIND(MathFFPLibrary, SPCmp),
+        BIND(MathFFPLibrary, SPTst),
+        BIND(MathFFPLibrary, SPAbs),
+        BIND(MathFFPLibrary, SPNeg),
+        BIND(MathFFPLibrary, SPAdd),
+        BIND(MathFFPLibrary, SPSub),
+        BIND(MathFFPLibrary, SPMul),
+        BIND(MathFFPLibrary, SPDiv),
+        BIND(MathFFPLibrary, SPFloor),
+        BIND(MathFFPLibrary, SPCeil)
+    };
+    static const LibraryImage image(MATHFFP_LIB_LVOS, bindings);
+    setupJumpTable(base, image);
+}
+
+
+int32_t MathFFPLibrary::SPFix(Ffp<D0> parm)
+{
+    return fix(parm);
+}
+
+
+FfpVal MathFFPLibrary::SPFlt(I32<D0> integer)
+{
+    return {(float) integer};
+}
+
+
+//
+// SPCmp
+// D1: left operand
+// D0: right operand
+// returns: 1 if right > left, -1 if right < left, 0 if both are equal (condition codes are set accordingly)
+//
+int32_t MathFFPLibrary::SPCmp(Ffp<D1> leftParm, Ffp<D0> rightParm)
+{
+    return compare(rightParm, leftParm);
+}
+
+
+int32_t MathFFPLibrary::SPTst(Ffp<D1> parm)
+{
+    return compare(parm, 0.0);
+}
+
+
+FfpVal MathFFPLibrary::SPAbs(Ffp<D0> parm)
+{
+    return {fabsf(parm)};
+}
+
+
+FfpVal MathFFPLibrary::SPNeg(Ffp<D0> parm)
+{
+    return {-parm.value};
+}
+
+
+FfpVal MathFFPLibrary::SPAdd(Ffp<D1> leftParm, Ffp<D0> rightParm)
+{
+    return {rightParm + leftParm};
+}
+
+
+FfpVal MathFFPLibrary::SPSub(Ffp<D1> leftParm, Ffp<D0> rightParm)
+{
+    return {rightParm - leftParm};
+}
+
+
+FfpVal MathFFPLibrary::SPMul(Ffp<D1> leftParm, Ffp<D0> rightParm)
+{
+    return {rightParm * leftParm};
+}
+
+
+FfpVal MathFFPLibrary::SPDiv(Ffp<D1> leftParm, Ffp<D0> rightParm)
+{
+    return {rightParm / leftParm};
+}
+
+
+FfpVal MathFFPLibrary::SPFloor(Ffp<D0> parm)
+{
+    return {floorf(parm)};
+}
+
+
+FfpVal MathFFPLibrary::SPCeil(Ffp<D0> parm)
+{
+    return {ceilf(parm)};
+}
@@ -5,110 +5,1166 @@
 //
 
 
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <signal.h>
 #include "memory.h"
+#include "blockcache.h"
+#include "tlsf.h"
+
+
+// The page table g_pagetab is what the memory access functions use. It normally is a copy of the actual mapping in
+// s_pages, but if the instrumentation is enabled, all its entries point to the instrumented handlers, which count and
+// trace each access and then perform it according to s_pages. This way the normal accesses don't pay anything for
+// the instrumentation.
+static MEMORY_PAGE_ENTRY s_pages[MEM_NUM_PAGES];
+static bool s_instrumented = false;
+static MEMORY_ACCESS_STATS s_stats;
+
+// Journal of the writes for the cross-check of the block cache: once it is enabled, all writes go through the
+// journaled handlers (or the instrumented ones), and while it is recording, the old value of each byte written is
+// appended to s_journal. The values written by the first run of a block are kept in s_journalResult while the
+// second run is recorded.
+typedef struct
+{
+    uint32_t je_address;
+    uint8_t  je_value;
+} JOURNAL_ENTRY;
+
+static bool s_journalEnabled = false;
+static bool s_journaling     = false;
+static std::vector<JOURNAL_ENTRY> s_journal;
+static std::map<uint32_t, uint8_t> s_journalResult;
+
+// area occupied by the hunks of the program, instructions and PC-relative data inside it are fetched directly
+static uint32_t s_codeStart = 0;
+static uint32_t s_codeSize  = 0;
+
+// area reserved for the memory of the VM, including the guard areas below and above it
+static uint8_t *s_area     = nullptr;
+static size_t  s_areaSize  = 0;
+
+
+//
+// signal handler for accesses to the guard areas around the memory of the VM
+//
+static void guardAreaHandler(int signum, siginfo_t *info, void *context)
+{
+    uint8_t *addr = (uint8_t *) info->si_addr;
+    if ((addr >= s_area) && (addr < s_area + s_areaSize)) {
+        // We're in a signal handler, so we can't use the logger here.
+        char msg[100];
+        int len = snprintf(msg, sizeof(msg), "FATAL: access outside the memory of the VM (offset %ld)\n", (long) (addr - g_mem));
+        if (write(STDERR_FILENO, msg, len) < 0) {}  // nothing we could do about it, we exit anyway
+        _exit(1);
+    }
+
+    // not our business => default action for the signal
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
 
 
 //
 // methods of MemoryManager
 //
-MemoryManager::MemoryManager()
+MemoryManager::MemoryManager(const bool hugePages, const HeapAllocator allocator)
 {
-    // allocate memory for our VM and fill code area with STOP instructions
-    g_mem = new uint8_t[ADDR_MEM_END - ADDR_MEM_START + 1];
-    for (uint16_t *p = (uint16_t *) (g_mem + ADDR_CODE_START + 10); p < (uint16_t *) (g_mem + ADDR_CODE_END); ++p)
-        *p = 0x724e;
+    // Reserve the memory for our VM. The pages are only materialized by the OS when they are touched for the first
+    // time (and are then filled with zeros), so we don't pay for memory the program doesn't use. The memory is
+    // surrounded by inaccessible guard areas so that accesses by the host which run past the memory of the VM (for
+    // example when copying a string that isn't terminated) crash instead of silently corrupting the emulator.
+    // The memory is aligned to MEM_GUARD_SIZE, which is also the size of a huge page.
+    const size_t memsize = ADDR_MEM_END - ADDR_MEM_START + 1;
+    s_areaSize = memsize + 3 * MEM_GUARD_SIZE;
+    s_area = (uint8_t *) mmap(NULL, s_areaSize, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (s_area == MAP_FAILED) {
+        LOG4CXX_FATAL(g_logger, "could not reserve memory for the VM: " << strerror(errno));
+        throw std::runtime_error("out of memory");
+    }
+    g_mem = (uint8_t *) (((uintptr_t) s_area + 2 * MEM_GUARD_SIZE - 1) & ~((uintptr_t) MEM_GUARD_SIZE - 1));
+    if (mprotect(g_mem, memsize, PROT_READ | PROT_WRITE) != 0) {
+        LOG4CXX_FATAL(g_logger, "could not make memory for the VM accessible: " << strerror(errno));
+        throw std::runtime_error("out of memory");
+    }
+    if (hugePages) {
+#ifdef MADV_HUGEPAGE
+        LOG4CXX_INFO(g_logger, "using transparent huge pages for the memory of the VM");
+        if (madvise(g_mem, memsize, MADV_HUGEPAGE) != 0)
+            LOG4CXX_WARN(g_logger, "could not enable transparent huge pages: " << strerror(errno));
+#else
+        LOG4CXX_WARN(g_logger, "transparent huge pages are not supported on this platform");
+#endif
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guardAreaHandler;
+    action.sa_flags     = SA_SIGINFO;
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+
+    // setup page table: everything below the code area is plain RAM, the code area is read directly but written
+    // through handlers (the jump tables of the libraries are mapped on top of it when the libraries are created)
+    mapPages(ADDR_MEM_START, ADDR_CODE_START - 1, &g_ramPageHandlers, true, true);
+    mapPages(ADDR_CODE_START, ADDR_CODE_END, &g_codePageHandlers, true, false);
 
     // initialize memory pool
-    m_lastMemAddr = PTR_M68K_TO_HOST(ADDR_HEAP_START);
+    memset(&m_heapStats, 0, sizeof(m_heapStats));
+    m_blocks = nullptr;
+    m_tlsf   = nullptr;
+    if (allocator == HEAP_TLSF) {
+        LOG4CXX_INFO(g_logger, "using TLSF allocator for the heap");
+        m_tlsf = new TlsfHeap();
+    }
+    else {
+        m_blocks    = allocHeapBlocks(HEAP_NUM_GRANULES);
+        m_top       = 0;
+        m_lastBlock = HEAP_NONE;
+        for (uint32_t bin = 0; bin < MEMORY_NUM_BINS; ++bin)
+            m_bins[bin] = HEAP_NONE;
+        m_binMask = 0;
+    }
 }
 
 
 MemoryManager::~MemoryManager()
 {
-    delete[] g_mem;
+    delete m_tlsf;
+    if (m_blocks)
+        freeHeapBlocks(m_blocks, HEAP_NUM_GRANULES);
+    munmap(s_area, s_areaSize);
 }
 
 
-uint8_t *MemoryManager::alloc(uint32_t size)
+//
+// allocate / free a block on the heap with the allocator selected when the memory manager was created
+//
+uint8_t *MemoryManager::alloc(const uint32_t size)
 {
-    // This simple algorithm for memory allocation is based on this article: http://www.ibm.com/developerworks/library/l-memory/
-    // It is not suitable for a real application (because of fragmentation and probably also performance).
-    // We always allocate at least MEMORY_MIN_BLOCK_SIZE bytes.
-    if (size < MEMORY_MIN_BLOCK_SIZE)
-        size = MEMORY_MIN_BLOCK_SIZE;
+    uint8_t *ptr = m_tlsf ? m_tlsf->alloc(size) : allocFromBins(size);
+    if (ptr == nullptr) {
+        ++m_heapStats.mhs_failures;
+        LOG4CXX_FATAL(g_logger, "out of memory - could not allocate block of " << size << " bytes");
+        throw std::runtime_error("out of memory");
+    }
 
-    uint8_t *ptr = PTR_M68K_TO_HOST(ADDR_HEAP_START);
-    MEMORY_CONTROLL_BLOCK *mcb, *newmcb;
+    ++m_heapStats.mhs_allocs;
+    m_heapStats.mhs_bytesInUse += m_tlsf ? m_tlsf->blockSize(ptr) : HEAP_BLOCK_SIZE(m_blocks[heapGranule(ptr)]);
+    if (m_heapStats.mhs_bytesInUse > m_heapStats.mhs_peakBytesInUse)
+        m_heapStats.mhs_peakBytesInUse = m_heapStats.mhs_bytesInUse;
+    return ptr;
+}
 
-    // walk through list of previously allocated blocks and see if there is a free one that fits
-    while (ptr != m_lastMemAddr) {
-        mcb = (MEMORY_CONTROLL_BLOCK *) ptr;
-        if (mcb->mcb_isFree && (mcb->mcb_size >= size)) {
-            mcb->mcb_isFree = false;
-            // If this block can hold both the requested amount of bytes and at least MEMORY_MIN_BLOCK_SIZE bytes we split it.
-            if ((mcb->mcb_size - size) >= MEMORY_MIN_BLOCK_SIZE) {
-                LOG4CXX_DEBUG(g_logger, Poco::format("splitting block of %u bytes at address 0x%08x", mcb->mcb_size, PTR_HOST_TO_M68K(ptr)));
-                newmcb = (MEMORY_CONTROLL_BLOCK *) (ptr + sizeof(MEMORY_CONTROLL_BLOCK) + size);
-                newmcb->mcb_isFree = true;
-                newmcb->mcb_size   = mcb->mcb_size - size - sizeof(MEMORY_CONTROLL_BLOCK);
-                mcb->mcb_size = size;
-            }
-            LOG4CXX_DEBUG(g_logger, Poco::format("reusing block of %u bytes at address 0x%08x from pool", mcb->mcb_size, PTR_HOST_TO_M68K(ptr)));
-            return ptr + sizeof(MEMORY_CONTROLL_BLOCK);
+
+//
+// Addresses that are not the start of an allocated block (including blocks that have already been freed) are
+// detected with the metadata of the heap and ignored.
+//
+void MemoryManager::free(uint8_t *ptr)
+{
+    const uint32_t bsize = m_tlsf ? m_tlsf->free(ptr) : freeToBins(ptr);
+    if (bsize == 0) {
+        ++m_heapStats.mhs_invalidFrees;
+        LOG4CXX_ERROR(g_logger, Poco::format("address 0x%08x is not an allocated block of the heap, not freeing it", PTR_HOST_TO_M68K(ptr)));
+        return;
+    }
+    ++m_heapStats.mhs_frees;
+    m_heapStats.mhs_bytesInUse -= bsize;
+}
+
+
+void MemoryManager::reportHeapStats()
+{
+    LOG4CXX_INFO(g_logger, "heap: " << m_heapStats.mhs_allocs << " blocks allocated, " << m_heapStats.mhs_frees << " freed, "
+        << m_heapStats.mhs_bytesInUse << " bytes still in use, peak " << m_heapStats.mhs_peakBytesInUse << " bytes");
+    if (m_heapStats.mhs_failures)
+        LOG4CXX_WARN(g_logger, "heap: " << m_heapStats.mhs_failures << " allocations failed");
+    if (m_heapStats.mhs_invalidFrees)
+        LOG4CXX_WARN(g_logger, "heap: " << m_heapStats.mhs_invalidFrees << " invalid frees");
+}
+
+
+//
+// The table with the metadata of the heap has an entry for each granule (4MB for a heap of 16MB), but only the
+// entries of granules where blocks start are ever touched. So it is mapped as anonymous memory, which the kernel
+// fills with zeros (HEAP_BLOCK_UNUSED) page by page when it is accessed first, instead of allocating and clearing
+// it at once, which would cost the whole size in RSS before the program has even started.
+//
+HEAP_BLOCK *allocHeapBlocks(const uint32_t n)
+{
+    void *blocks = mmap(NULL, n * sizeof(HEAP_BLOCK), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (blocks == MAP_FAILED) {
+        LOG4CXX_FATAL(g_logger, "could not map table for the metadata of the heap: " << strerror(errno));
+        throw std::runtime_error("out of memory");
+    }
+    return (HEAP_BLOCK *) blocks;
+}
+
+
+void freeHeapBlocks(HEAP_BLOCK *blocks, const uint32_t n)
+{
+    munmap(blocks, n * sizeof(HEAP_BLOCK));
+}
+
+
+//
+// The heap is a sequence of blocks whose metadata is kept in m_blocks. Blocks that have been freed are kept in lists
+// by their size (segregated free lists), so finding a free block doesn't depend on the number of blocks on the heap.
+// Each list (bin) holds blocks whose size is between HEAP_GRANULE_SIZE << i and twice that size. A block from a bin
+// above the one of the requested size always fits, so we only have to search the bin of the size itself if all
+// bins above it are empty. Blocks are only carved from the top of the heap if no free block fits.
+//
+// When a block is freed, it is merged with the free blocks in front of and behind it, so there are never two free
+// blocks next to each other. A free block at the top of the heap is given back to the top, so m_top moves down again.
+//
+uint32_t MemoryManager::binIndex(const uint32_t size)
+{
+    const uint32_t bin = 31 - __builtin_clz(size >> HEAP_GRANULE_SHIFT);
+    return (bin < MEMORY_NUM_BINS) ? bin : MEMORY_NUM_BINS - 1;
+}
+
+
+// returns the block behind block or HEAP_NONE if block is the last one
+uint32_t MemoryManager::nextBlock(const uint32_t block) const
+{
+    const uint32_t next = block + (HEAP_BLOCK_SIZE(m_blocks[block]) >> HEAP_GRANULE_SHIFT);
+    return (next != m_top) ? next : HEAP_NONE;
+}
+
+
+void MemoryManager::insertFree(const uint32_t block)
+{
+    HEAP_BLOCK &hb = m_blocks[block];
+    const uint32_t bin = binIndex(HEAP_BLOCK_SIZE(hb));
+    hb.hb_nextFree = m_bins[bin];
+    hb.hb_prevFree = HEAP_NONE;
+    if (m_bins[bin] != HEAP_NONE)
+        m_blocks[m_bins[bin]].hb_prevFree = block;
+    m_bins[bin] = block;
+    m_binMask |= 1 << bin;
+    hb.hb_size = HEAP_BLOCK_SIZE(hb) | HEAP_BLOCK_FREE;
+}
+
+
+void MemoryManager::removeFree(const uint32_t block)
+{
+    HEAP_BLOCK &hb = m_blocks[block];
+    const uint32_t bin = binIndex(HEAP_BLOCK_SIZE(hb));
+    if (hb.hb_prevFree != HEAP_NONE)
+        m_blocks[hb.hb_prevFree].hb_nextFree = hb.hb_nextFree;
+    else if ((m_bins[bin] = hb.hb_nextFree) == HEAP_NONE)
+        m_binMask &= ~(1 << bin);
+    if (hb.hb_nextFree != HEAP_NONE)
+        m_blocks[hb.hb_nextFree].hb_prevFree = hb.hb_prevFree;
+    hb.hb_size = HEAP_BLOCK_SIZE(hb) | HEAP_BLOCK_USED;
+}
+
+
+// take a free block (already removed from its bin) for an allocation of size bytes
+uint8_t *MemoryManager::useBlock(const uint32_t block, const uint32_t size)
+{
+    HEAP_BLOCK &hb = m_blocks[block];
+    const uint32_t bsize = HEAP_BLOCK_SIZE(hb);
+    // split off the rest of the block if it is large enough
+    if (bsize > size) {
+        LOG4CXX_DEBUG(g_logger, Poco::format("splitting block of %u bytes at address 0x%08x", bsize, HEAP_GRANULE_ADDR(block)));
+        const uint32_t rest = block + (size >> HEAP_GRANULE_SHIFT);
+        m_blocks[rest].hb_size     = bsize - size;
+        m_blocks[rest].hb_prevPhys = block;
+        const uint32_t next = nextBlock(block);
+        if (next != HEAP_NONE)
+            m_blocks[next].hb_prevPhys = rest;
+        hb.hb_size = size | HEAP_BLOCK_USED;
+        insertFree(rest);
+    }
+    LOG4CXX_DEBUG(g_logger, Poco::format("reusing block of %u bytes at address 0x%08x from pool", size, HEAP_GRANULE_ADDR(block)));
+    return PTR_M68K_TO_HOST(HEAP_GRANULE_ADDR(block));
+}
+
+
+// returns nullptr if there is not enough memory
+uint8_t *MemoryManager::allocFromBins(uint32_t size)
+{
+    // sizes are rounded up to whole granules, so all blocks are aligned to HEAP_GRANULE_SIZE
+    if (size > ADDR_HEAP_END - ADDR_HEAP_START + 1)
+        return nullptr;
+    size = (size + HEAP_GRANULE_SIZE - 1) & ~(HEAP_GRANULE_SIZE - 1);
+    if (size == 0)
+        size = HEAP_GRANULE_SIZE;
+
+    // first block in the bin of the size if it fits, otherwise first block of the next bin that isn't empty,
+    // otherwise the first block in the bin of the size that fits
+    const uint32_t bin = binIndex(size);
+    uint32_t block = m_bins[bin];
+    if ((block != HEAP_NONE) && (HEAP_BLOCK_SIZE(m_blocks[block]) >= size)) {
+        removeFree(block);
+        return useBlock(block, size);
+    }
+    const uint32_t above = (bin + 1 < MEMORY_NUM_BINS) ? (m_binMask & ~((2u << bin) - 1)) : 0;
+    if (above) {
+        block = m_bins[__builtin_ctz(above)];
+        removeFree(block);
+        return useBlock(block, size);
+    }
+    for (; block != HEAP_NONE; block = m_blocks[block].hb_nextFree) {
+        if (HEAP_BLOCK_SIZE(m_blocks[block]) >= size) {
+            removeFree(block);
+            return useBlock(block, size);
         }
-        ptr += sizeof(MEMORY_CONTROLL_BLOCK) + mcb->mcb_size;
     }
 
-    // no suitable block found => allocate a new one
-    if ((ADDR_HEAP_END - PTR_HOST_TO_M68K(m_lastMemAddr)) >= (sizeof(MEMORY_CONTROLL_BLOCK) + size)) {
-        mcb = (MEMORY_CONTROLL_BLOCK *) ptr;        // already points to m_lastMemAddr
-        mcb->mcb_isFree = false;
-        mcb->mcb_size    = size;
-        m_lastMemAddr += sizeof(MEMORY_CONTROLL_BLOCK) + size;
-        LOG4CXX_DEBUG(g_logger, Poco::format("allocating block of %u bytes at address 0x%08x from pool", mcb->mcb_size, PTR_HOST_TO_M68K(ptr)));
-        return ptr + sizeof(MEMORY_CONTROLL_BLOCK);
+    // no suitable block found => allocate a new one (the block in front of the top is never free, it would have been
+    // merged into the top)
+    if (((HEAP_NUM_GRANULES - m_top) << HEAP_GRANULE_SHIFT) < size)
+        return nullptr;
+    block = m_top;
+    m_blocks[block].hb_size     = size | HEAP_BLOCK_USED;
+    m_blocks[block].hb_prevPhys = m_lastBlock;
+    m_lastBlock = block;
+    m_top += size >> HEAP_GRANULE_SHIFT;
+    LOG4CXX_DEBUG(g_logger, Poco::format("allocating block of %u bytes at address 0x%08x from pool", size, HEAP_GRANULE_ADDR(block)));
+    return PTR_M68K_TO_HOST(HEAP_GRANULE_ADDR(block));
+}
+
+
+// returns the size of the block or 0 if ptr is not an allocated block
+uint32_t MemoryManager::freeToBins(const uint8_t *ptr)
+{
+    uint32_t block = heapGranule(ptr);
+    if ((block == HEAP_NONE) || (block >= m_top) || (HEAP_BLOCK_STATE(m_blocks[block]) != HEAP_BLOCK_USED))
+        return 0;
+    const uint32_t size = HEAP_BLOCK_SIZE(m_blocks[block]);
+
+    // merge with the free blocks in front of and behind this one, the entries of the blocks that are merged into
+    // another one are marked as unused
+    const uint32_t prev = m_blocks[block].hb_prevPhys;
+    if ((prev != HEAP_NONE) && (HEAP_BLOCK_STATE(m_blocks[prev]) == HEAP_BLOCK_FREE)) {
+        removeFree(prev);
+        m_blocks[prev].hb_size += size;
+        m_blocks[block].hb_size = HEAP_BLOCK_UNUSED;
+        block = prev;
+    }
+    uint32_t next = nextBlock(block);
+    if ((next != HEAP_NONE) && (HEAP_BLOCK_STATE(m_blocks[next]) == HEAP_BLOCK_FREE)) {
+        removeFree(next);
+        m_blocks[block].hb_size += HEAP_BLOCK_SIZE(m_blocks[next]);
+        m_blocks[next].hb_size = HEAP_BLOCK_UNUSED;
+    }
+
+    if ((next = nextBlock(block)) == HEAP_NONE) {
+        LOG4CXX_DEBUG(g_logger, Poco::format("returning block of %u bytes at address 0x%08x to the top of the heap",
+            HEAP_BLOCK_SIZE(m_blocks[block]), HEAP_GRANULE_ADDR(block)));
+        m_top       = block;
+        m_lastBlock = m_blocks[block].hb_prevPhys;
+        m_blocks[block].hb_size = HEAP_BLOCK_UNUSED;
     }
     else {
-        LOG4CXX_FATAL(g_logger, "out of memory - could not allocate block of " << size << " bytes");
-        throw std::runtime_error("out of memory");
+        m_blocks[next].hb_prevPhys = block;
+        insertFree(block);
     }
+    return size;
 }
 
 
-void MemoryManager::free(uint8_t *ptr)
+//
+// methods of SlabPool
+//
+SlabPool::SlabPool(MemoryManager *memmgr, const std::string &name, const uint32_t objSize)
+    : m_memmgr(memmgr), m_name(name), m_objSize((objSize + 3) & ~3), m_allocs(0), m_inUse(0), m_peakInUse(0)
+{
+}
+
+
+SlabPool::~SlabPool()
+{
+    LOG4CXX_DEBUG(g_logger, "pool " << m_name << ": " << m_allocs << " objects allocated, peak " << m_peakInUse
+        << " in use, " << m_slabs.size() << " slabs");
+    if (m_inUse)
+        LOG4CXX_WARN(g_logger, "pool " << m_name << ": " << m_inUse << " objects have not been freed");
+    for (const auto &slab : m_slabs)
+        m_memmgr->free(PTR_M68K_TO_HOST(slab.first));
+}
+
+
+//
+// returns the address of a cleared object, throws an exception if there is not enough memory
+//
+uint32_t SlabPool::alloc()
+{
+    if (m_free.empty()) {
+        const uint32_t slab = PTR_HOST_TO_M68K(m_memmgr->alloc(SLAB_NUM_OBJECTS * m_objSize));
+        LOG4CXX_DEBUG(g_logger, "pool " << m_name << Poco::format(": new slab at address 0x%08x", slab));
+        m_slabs[slab] = 0;
+        for (uint32_t i = SLAB_NUM_OBJECTS; i-- > 0; )
+            m_free.push_back(slab + i * m_objSize);
+    }
+    const uint32_t obj = m_free.back();
+    m_free.pop_back();
+
+    auto slab = --m_slabs.upper_bound(obj);
+    slab->second |= 1u << ((obj - slab->first) / m_objSize);
+    fillGuest(obj, 0, m_objSize);
+    ++m_allocs;
+    if (++m_inUse > m_peakInUse)
+        m_peakInUse = m_inUse;
+    return obj;
+}
+
+
+void SlabPool::free(const uint32_t obj)
+{
+    auto slab = m_slabs.upper_bound(obj);
+    if (slab != m_slabs.begin()) {
+        --slab;
+        const uint32_t offset = obj - slab->first;
+        if ((offset < SLAB_NUM_OBJECTS * m_objSize) && (offset % m_objSize == 0) &&
+            (slab->second & (1u << (offset / m_objSize)))) {
+            slab->second &= ~(1u << (offset / m_objSize));
+            m_free.push_back(obj);
+            --m_inUse;
+            return;
+        }
+    }
+    LOG4CXX_ERROR(g_logger, "pool " << m_name << Poco::format(": address 0x%08x is not an object in use, not freeing it", obj));
+}
+
+
+//
+// map the pages containing the addresses start - end to the handlers, rdirect / wdirect specify if the pages can be
+// read / written directly (without calling the handlers)
+//
+void MemoryManager::mapPages(const uint32_t start, const uint32_t end, const MEMORY_PAGE_HANDLERS *handlers, const bool rdirect, const bool wdirect)
+{
+    LOG4CXX_DEBUG(g_logger, Poco::format("mapping pages for addresses 0x%08x - 0x%08x to %s handlers", start, end, std::string(handlers->mph_name)));
+    for (uint32_t page = MEM_PAGE_INDEX(start); page <= MEM_PAGE_INDEX(end); ++page) {
+        s_pages[page].mpe_rmem     = rdirect ? g_mem : nullptr;
+        s_pages[page].mpe_wmem     = wdirect ? g_mem : nullptr;
+        s_pages[page].mpe_handlers = handlers;
+        if (s_instrumented)
+            continue;
+        g_pagetab[page] = s_pages[page];
+        if (s_journalEnabled) {
+            g_pagetab[page].mpe_wmem     = nullptr;
+            g_pagetab[page].mpe_handlers = &g_journaledPageHandlers;
+        }
+    }
+}
+
+
+//
+// switch to the instrumented handlers (must be called before the program is started)
+//
+void MemoryManager::enableInstrumentation()
+{
+    LOG4CXX_INFO(g_logger, "using instrumented memory handlers");
+    s_instrumented = true;
+    for (uint32_t page = 0; page < MEM_NUM_PAGES; ++page) {
+        g_pagetab[page].mpe_rmem     = nullptr;
+        g_pagetab[page].mpe_wmem     = nullptr;
+        g_pagetab[page].mpe_handlers = &g_instrumentedPageHandlers;
+    }
+}
+
+
+//
+// switch to the journaled handlers for writes (must be called before the program is started), see m68k_start_journal()
+//
+void MemoryManager::enableJournal()
+{
+    LOG4CXX_INFO(g_logger, "recording writes to memory for the cross-check of the block cache");
+    s_journalEnabled = true;
+    if (s_instrumented)
+        return;
+    for (uint32_t page = 0; page < MEM_NUM_PAGES; ++page) {
+        g_pagetab[page].mpe_wmem     = nullptr;
+        g_pagetab[page].mpe_handlers = &g_journaledPageHandlers;
+    }
+}
+
+
+//
+// set the area the program has been loaded into (used for fetching instructions and their operands)
+//
+void MemoryManager::setCodeArea(const uint32_t start, const uint32_t size)
+{
+    // With the instrumented handlers all instructions are fetched through the handlers so they get traced as well.
+    if (s_instrumented)
+        return;
+
+    LOG4CXX_DEBUG(g_logger, Poco::format("fetching instructions directly from 0x%08x - 0x%08x", start, start + size - 1));
+    s_codeStart = start;
+    s_codeSize  = size;
+}
+
+
+void MemoryManager::reportAccessStats()
+{
+    if (!s_instrumented)
+        return;
+
+    LOG4CXX_INFO(g_logger, "memory accesses (8 / 16 / 32 bit): "
+        << s_stats.mas_reads[0] << " / " << s_stats.mas_reads[1] << " / " << s_stats.mas_reads[2] << " reads, "
+        << s_stats.mas_writes[0] << " / " << s_stats.mas_writes[1] << " / " << s_stats.mas_writes[2] << " writes");
+    if (s_stats.mas_illegalReads || s_stats.mas_illegalWrites)
+        LOG4CXX_WARN(g_logger, "illegal memory accesses: " << s_stats.mas_illegalReads << " reads, " << s_stats.mas_illegalWrites << " writes");
+}
+
+
+//
+// functions for copying data between host and guest memory and bulk operations on guest memory
+//
+// They work directly on g_mem, bypassing the handlers of the pages (so they can also write to read-only pages like
+// the jump tables of the libraries), and drop blocks of code from the block cache they overwrite. Without
+// VADM_SWAPPED_MEMORY the bytes in g_mem are in the order of the M68K, so the (vectorized) routines of the C library
+// of the host are used.
+//
+
+// check that the area is inside the memory of the VM
+void checkGuestRange(const uint32_t addr, const uint32_t len)
+{
+    if ((addr > ADDR_MEM_END) || (len > ADDR_MEM_END - addr + 1)) {
+        LOG4CXX_ERROR(g_logger, Poco::format("access to 0x%08x (%u bytes) is outside of the memory of the VM", addr, len));
+        throw std::runtime_error("access outside of memory");
+    }
+}
+
+
+// append the old values of the bytes about to be written to the journal
+static inline void recordWrite(const uint32_t addr, const uint32_t len)
+{
+    if (!s_journaling)
+        return;
+    for (uint32_t i = 0; i < len; ++i)
+        s_journal.push_back({(addr + i) & ADDR_MEM_MASK, (uint8_t) READ_BYTE(g_mem, (addr + i) & ADDR_MEM_MASK)});
+}
+
+
+void copyToGuest(const uint32_t dst, const void *src, const uint32_t len)
+{
+    checkGuestRange(dst, len);
+    recordWrite(dst, len);
+#ifdef VADM_SWAPPED_MEMORY
+    const uint8_t *p = (const uint8_t *) src;
+    for (uint32_t i = 0; i < len; ++i)
+        g_mem[GUEST_BYTE_ADDR(dst + i)] = p[i];
+#else
+    memcpy(g_mem + dst, src, len);
+#endif
+    // the program might have been executed already from the area being overwritten
+    m68k_invalidate_blocks(dst, len);
+}
+
+
+void copyFromGuest(void *dst, const uint32_t src, const uint32_t len)
+{
+    checkGuestRange(src, len);
+#ifdef VADM_SWAPPED_MEMORY
+    uint8_t *p = (uint8_t *) dst;
+    for (uint32_t i = 0; i < len; ++i)
+        p[i] = g_mem[GUEST_BYTE_ADDR(src + i)];
+#else
+    memcpy(dst, g_mem + src, len);
+#endif
+}
+
+
+// copy len bytes inside guest memory (the areas may overlap)
+void moveInGuest(const uint32_t dst, const uint32_t src, const uint32_t len)
+{
+    checkGuestRange(dst, len);
+    checkGuestRange(src, len);
+    recordWrite(dst, len);
+#ifdef VADM_SWAPPED_MEMORY
+    if (dst < src) {
+        for (uint32_t i = 0; i < len; ++i)
+            g_mem[GUEST_BYTE_ADDR(dst + i)] = g_mem[GUEST_BYTE_ADDR(src + i)];
+    }
+    else {
+        for (uint32_t i = len; i > 0; --i)
+            g_mem[GUEST_BYTE_ADDR(dst + i - 1)] = g_mem[GUEST_BYTE_ADDR(src + i - 1)];
+    }
+#else
+    memmove(g_mem + dst, g_mem + src, len);
+#endif
+    m68k_invalidate_blocks(dst, len);
+}
+
+
+void fillGuest(const uint32_t addr, const uint8_t value, const uint32_t len)
+{
+    checkGuestRange(addr, len);
+    recordWrite(addr, len);
+#ifdef VADM_SWAPPED_MEMORY
+    for (uint32_t i = 0; i < len; ++i)
+        g_mem[GUEST_BYTE_ADDR(addr + i)] = value;
+#else
+    memset(g_mem + addr, value, len);
+#endif
+    m68k_invalidate_blocks(addr, len);
+}
+
+
+// compare len bytes like memcmp()
+int compareGuest(const uint32_t addr1, const uint32_t addr2, const uint32_t len)
+{
+    checkGuestRange(addr1, len);
+    checkGuestRange(addr2, len);
+#ifdef VADM_SWAPPED_MEMORY
+    for (uint32_t i = 0; i < len; ++i) {
+        const int diff = g_mem[GUEST_BYTE_ADDR(addr1 + i)] - g_mem[GUEST_BYTE_ADDR(addr2 + i)];
+        if (diff != 0)
+            return diff;
+    }
+    return 0;
+#else
+    return memcmp(g_mem + addr1, g_mem + addr2, len);
+#endif
+}
+
+
+// search the first of the len bytes at addr that is equal to value
+// returns: true if found (its address is stored in pos)
+bool findInGuest(const uint32_t addr, const uint8_t value, const uint32_t len, uint32_t &pos)
+{
+    checkGuestRange(addr, len);
+#ifdef VADM_SWAPPED_MEMORY
+    for (uint32_t i = 0; i < len; ++i) {
+        if (g_mem[GUEST_BYTE_ADDR(addr + i)] == value) {
+            pos = addr + i;
+            return true;
+        }
+    }
+    return false;
+#else
+    const uint8_t *p = (const uint8_t *) memchr(g_mem + addr, value, len);
+    if (p)
+        pos = p - g_mem;
+    return p != nullptr;
+#endif
+}
+
+
+// length of the string at addr, but at most max (strings are also cut off at the end of the memory)
+uint32_t guestStrnlen(const uint32_t addr, uint32_t max)
+{
+    checkGuestRange(addr, 0);
+    if (max > ADDR_MEM_END - addr + 1)
+        max = ADDR_MEM_END - addr + 1;
+    uint32_t pos;
+    return findInGuest(addr, 0, max, pos) ? pos - addr : max;
+}
+
+
+// length of the string at addr (which must be terminated inside the memory)
+uint32_t guestStrlen(const uint32_t addr)
+{
+    const uint32_t len = guestStrnlen(addr, ADDR_MEM_END + 1);
+    checkGuestRange(addr, len + 1);
+    return len;
+}
+
+
+std::string readGuestString(const uint32_t addr)
+{
+    std::string str(guestStrlen(addr), '\0');
+    copyFromGuest(&str[0], addr, str.size());
+    return str;
+}
+
+
+// copies at most bufsize - 1 characters and always terminates the string with a NUL byte
+void writeGuestString(const uint32_t addr, const char *str, const uint32_t bufsize)
 {
-    MEMORY_CONTROLL_BLOCK *mcb = (MEMORY_CONTROLL_BLOCK *) (ptr - sizeof(MEMORY_CONTROLL_BLOCK));
-    mcb->mcb_isFree = true;
+    uint32_t len = strlen(str);
+    if (len >= bufsize)
+        len = bufsize - 1;
+    copyToGuest(addr, str, len);
+    fillGuest(addr + len, 0, 1);
 }
 
 
+//
+// bulk operations on behalf of the program (library routines, intercepted functions and the loop idioms of the
+// block cache)
+//
+
+// Returns true if all pages of the area are read / written directly (and not through handlers). The journaled
+// handlers are ignored because the bulk operations record their writes themselves.
+static bool isDirect(const uint32_t addr, const uint32_t len, const bool write)
+{
+    const MEMORY_PAGE_ENTRY *pagetab = (s_journalEnabled && !s_instrumented) ? s_pages : g_pagetab;
+
+    if ((addr > ADDR_MEM_END) || (len > ADDR_MEM_END - addr + 1))
+        return false;
+    if (len == 0)
+        return true;
+    for (uint32_t page = MEM_PAGE_INDEX(addr); page <= MEM_PAGE_INDEX(addr + len - 1); ++page) {
+        if ((write ? pagetab[page].mpe_wmem : pagetab[page].mpe_rmem) == nullptr)
+            return false;
+    }
+    return true;
+}
+
+
+// Like moveInGuest(), but the memory is accessed the same way as by a loop in the program if it is not plain RAM,
+// so for example writes to the jump tables of the libraries are ignored.
+void moveInGuestChecked(const uint32_t dst, const uint32_t src, const uint32_t len)
+{
+    if (isDirect(src, len, false) && isDirect(dst, len, true)) {
+        moveInGuest(dst, src, len);
+        return;
+    }
+    checkGuestRange(dst, len);
+    checkGuestRange(src, len);
+    if (dst < src) {
+        for (uint32_t i = 0; i < len; ++i)
+            m68k_write_8(dst + i, m68k_read_8(src + i));
+    }
+    else {
+        for (uint32_t i = len; i > 0; --i)
+            m68k_write_8(dst + i - 1, m68k_read_8(src + i - 1));
+    }
+}
+
+
+// like fillGuest(), but see moveInGuestChecked()
+void fillGuestChecked(const uint32_t addr, const uint8_t value, const uint32_t len)
+{
+    if (isDirect(addr, len, true)) {
+        fillGuest(addr, value, len);
+        return;
+    }
+    checkGuestRange(addr, len);
+    for (uint32_t i = 0; i < len; ++i)
+        m68k_write_8(addr + i, value);
+}
+
+
+extern "C"
+{
+    int m68k_bulk_move(uint32_t dst, uint32_t src, uint32_t len)
+    {
+        if (!isDirect(src, len, false) || !isDirect(dst, len, true))
+            return 0;
+        moveInGuest(dst, src, len);
+        return 1;
+    }
+
+
+    int m68k_bulk_fill(uint32_t dst, uint8_t value, uint32_t len)
+    {
+        if (!isDirect(dst, len, true))
+            return 0;
+        fillGuest(dst, value, len);
+        return 1;
+    }
+
+
+    // length of the string at addr including its NUL byte (the string is searched page by page as long as the
+    // pages are read directly)
+    int m68k_bulk_scan(uint32_t addr, uint32_t *len)
+    {
+        uint32_t pos = addr;
+        while (true) {
+            const uint32_t n = MEM_PAGE_SIZE - (pos & MEM_PAGE_OFFSET_MASK);
+            if (!isDirect(pos, n, false))
+                return 0;
+            uint32_t nul;
+            if (findInGuest(pos, 0, n, nul)) {
+                *len = nul - addr + 1;
+                return 1;
+            }
+            pos += n;
+        }
+    }
+
+
+    //
+    // journal of the writes for the cross-check of the block cache (the journal must have been enabled with
+    // MemoryManager::enableJournal())
+    //
+
+    // start recording the writes
+    void m68k_start_journal(void)
+    {
+        s_journal.clear();
+        s_journaling = true;
+    }
+
+
+    // stop recording, remember the values written and restore the old ones
+    void m68k_undo_journal(void)
+    {
+        s_journaling = false;
+        s_journalResult.clear();
+        for (const JOURNAL_ENTRY &je : s_journal)
+            s_journalResult[je.je_address] = READ_BYTE(g_mem, je.je_address);
+        for (auto je = s_journal.rbegin(); je != s_journal.rend(); ++je) {
+            WRITE_BYTE(g_mem, je->je_address, je->je_value);
+            m68k_invalidate_blocks(je->je_address, 1);
+        }
+    }
+
+
+    // stop recording, returns 0 if the memory differs from the values written by the run before m68k_undo_journal()
+    // (at the first address that differs, which is stored in address)
+    int m68k_compare_journal(uint32_t *address)
+    {
+        s_journaling = false;
+        for (const auto &result : s_journalResult) {
+            if (READ_BYTE(g_mem, result.first) != result.second) {
+                *address = result.first;
+                return 0;
+            }
+        }
+        // bytes written only by this run must still have their old value
+        for (const JOURNAL_ENTRY &je : s_journal) {
+            if ((s_journalResult.find(je.je_address) == s_journalResult.end()) && (READ_BYTE(g_mem, je.je_address) != je.je_value)) {
+                *address = je.je_address;
+                return 0;
+            }
+        }
+        return 1;
+    }
+}
+
+
+//
+// handlers for the different types of pages
+//
+static unsigned int readRam8(unsigned int address)
+{
+    return READ_BYTE(g_mem, address);
+}
+
+static unsigned int readRam16(unsigned int address)
+{
+    return READ_WORD(g_mem, address);
+}
+
+static unsigned int readRam32(unsigned int address)
+{
+    return READ_LONG(g_mem, address);
+}
+
+static void writeRam8(unsigned int address, unsigned int value)
+{
+    WRITE_BYTE(g_mem, address, value);
+}
+
+static void writeRam16(unsigned int address, unsigned int value)
+{
+    WRITE_WORD(g_mem, address, value);
+}
+
+static void writeRam32(unsigned int address, unsigned int value)
+{
+    WRITE_LONG(g_mem, address, value);
+}
+
+
+// Illegal accesses are silently ignored by these handlers, they are only reported by the instrumented handlers.
+static unsigned int readUnmapped8(unsigned int address)
+{
+    return 0x55;
+}
+
+static unsigned int readUnmapped16(unsigned int address)
+{
+    return 0xdead;
+}
+
+static unsigned int readUnmapped32(unsigned int address)
+{
+    return 0xdeadbeef;
+}
+
+static void writeIgnored(unsigned int address, unsigned int value)
+{
+}
+
+
+//
+// instrumented handlers
+//
+static void reportIllegalAccess(const char *type, unsigned int nbits, unsigned int address, const MEMORY_PAGE_HANDLERS *handlers)
+{
+    LOG4CXX_WARN(g_logger, Poco::format("illegal %u bit %s address 0x%08x (%s page), PC = 0x%08x",
+        nbits, std::string(type), address, std::string(handlers->mph_name), m68k_get_reg(NULL, M68K_REG_PPC)));
+}
+
+static unsigned int instrumentedRead(unsigned int address, unsigned int size)
+{
+    const MEMORY_PAGE_ENTRY *page = &s_pages[MEM_PAGE_INDEX(address)];
+    unsigned int value;
+
+    ++s_stats.mas_reads[size];
+    if (!page->mpe_handlers->mph_readable) {
+        ++s_stats.mas_illegalReads;
+        reportIllegalAccess("read from", 8 << size, address, page->mpe_handlers);
+    }
+    switch (size) {
+        case 0:
+            value = page->mpe_rmem ? READ_BYTE(page->mpe_rmem, address) : page->mpe_handlers->mph_read8(address);
+            LOG4CXX_TRACE(g_logger, Poco::format("8 bit read from address 0x%08x, value = 0x%02x", address, value));
+            break;
+        case 1:
+            value = page->mpe_rmem ? READ_WORD(page->mpe_rmem, address) : page->mpe_handlers->mph_read16(address);
+            LOG4CXX_TRACE(g_logger, Poco::format("16 bit read from address 0x%08x, value = 0x%04x", address, value));
+            break;
+        default:
+            value = page->mpe_rmem ? READ_LONG(page->mpe_rmem, address) : page->mpe_handlers->mph_read32(address);
+            LOG4CXX_TRACE(g_logger, Poco::format("32 bit read from address 0x%08x, value = 0x%08x", address, value));
+            break;
+    }
+    return value;
+}
+
+static void instrumentedWrite(unsigned int address, unsigned int size, unsigned int value)
+{
+    const MEMORY_PAGE_ENTRY *page = &s_pages[MEM_PAGE_INDEX(address)];
+
+    ++s_stats.mas_writes[size];
+    recordWrite(address, 1 << size);
+    if (!page->mpe_handlers->mph_writable) {
+        ++s_stats.mas_illegalWrites;
+        reportIllegalAccess("write to", 8 << size, address, page->mpe_handlers);
+    }
+    switch (size) {
+        case 0:
+            LOG4CXX_TRACE(g_logger, Poco::format("8 bit write to address 0x%08x, value = 0x%02x", address, value));
+            if (page->mpe_wmem) {
+                WRITE_BYTE(page->mpe_wmem, address, value);
+            }
+            else
+                page->mpe_handlers->mph_write8(address, value);
+            break;
+        case 1:
+            LOG4CXX_TRACE(g_logger, Poco::format("16 bit write to address 0x%08x, value = 0x%04x", address, value));
+            if (page->mpe_wmem) {
+                WRITE_WORD(page->mpe_wmem, address, value);
+            }
+            else
+                page->mpe_handlers->mph_write16(address, value);
+            break;
+        default:
+            LOG4CXX_TRACE(g_logger, Poco::format("32 bit write to address 0x%08x, value = 0x%08x", address, value));
+            if (page->mpe_wmem) {
+                WRITE_LONG(page->mpe_wmem, address, value);
+            }
+            else
+                page->mpe_handlers->mph_write32(address, value);
+            break;
+    }
+}
+
+static unsigned int instrumentedRead8(unsigned int address)
+{
+    return instrumentedRead(address, 0);
+}
+
+static unsigned int instrumentedRead16(unsigned int address)
+{
+    return instrumentedRead(address, 1);
+}
+
+static unsigned int instrumentedRead32(unsigned int address)
+{
+    return instrumentedRead(address, 2);
+}
+
+static void instrumentedWrite8(unsigned int address, unsigned int value)
+{
+    instrumentedWrite(address, 0, value);
+}
+
+static void instrumentedWrite16(unsigned int address, unsigned int value)
+{
+    instrumentedWrite(address, 1, value);
+}
+
+static void instrumentedWrite32(unsigned int address, unsigned int value)
+{
+    instrumentedWrite(address, 2, value);
+}
+
+
+//
+// journaled handlers (reads are only passed through, there is nothing to record for them)
+//
+static unsigned int journaledRead8(unsigned int address)
+{
+    return s_pages[MEM_PAGE_INDEX(address)].mpe_handlers->mph_read8(address);
+}
+
+static unsigned int journaledRead16(unsigned int address)
+{
+    return s_pages[MEM_PAGE_INDEX(address)].mpe_handlers->mph_read16(address);
+}
+
+static unsigned int journaledRead32(unsigned int address)
+{
+    return s_pages[MEM_PAGE_INDEX(address)].mpe_handlers->mph_read32(address);
+}
+
+static void journaledWrite8(unsigned int address, unsigned int value)
+{
+    const MEMORY_PAGE_ENTRY *page = &s_pages[MEM_PAGE_INDEX(address)];
+    recordWrite(address, 1);
+    if (page->mpe_wmem)
+        WRITE_BYTE(page->mpe_wmem, address, value);
+    else
+        page->mpe_handlers->mph_write8(address, value);
+}
+
+static void journaledWrite16(unsigned int address, unsigned int value)
+{
+    const MEMORY_PAGE_ENTRY *page = &s_pages[MEM_PAGE_INDEX(address)];
+    recordWrite(address, 2);
+    if (page->mpe_wmem) {
+        WRITE_WORD(page->mpe_wmem, address, value);
+    }
+    else
+        page->mpe_handlers->mph_write16(address, value);
+}
+
+static void journaledWrite32(unsigned int address, unsigned int value)
+{
+    const MEMORY_PAGE_ENTRY *page = &s_pages[MEM_PAGE_INDEX(address)];
+    recordWrite(address, 4);
+    if (page->mpe_wmem) {
+        WRITE_LONG(page->mpe_wmem, address, value);
+    }
+    else
+        page->mpe_handlers->mph_write32(address, value);
+}
+
+
+const MEMORY_PAGE_HANDLERS g_ramPageHandlers = {
+    "RAM", true, true, readRam8, readRam16, readRam32, writeRam8, writeRam16, writeRam32
+};
+
+// The jump tables of the libraries must not be modified by the programs, so writes to these pages are ignored.
+const MEMORY_PAGE_HANDLERS g_romPageHandlers = {
+    "ROM", true, false, readRam8, readRam16, readRam32, writeIgnored, writeIgnored, writeIgnored
+};
+
+// Writes to the code area (relocations done by the loader, data and BSS hunks, self-modifying code) are passed
+// through to the memory and reported to the block cache, which drops the blocks containing the written address.
+static void writeCode8(unsigned int address, unsigned int value)
+{
+    WRITE_BYTE(g_mem, address, value);
+    m68k_invalidate_blocks(address, 1);
+}
+
+static void writeCode16(unsigned int address, unsigned int value)
+{
+    WRITE_WORD(g_mem, address, value);
+    m68k_invalidate_blocks(address, 2);
+}
+
+static void writeCode32(unsigned int address, unsigned int value)
+{
+    WRITE_LONG(g_mem, address, value);
+    m68k_invalidate_blocks(address, 4);
+}
+
+const MEMORY_PAGE_HANDLERS g_codePageHandlers = {
+    "code", true, true, readRam8, readRam16, readRam32, writeCode8, writeCode16, writeCode32
+};
+
+const MEMORY_PAGE_HANDLERS g_unmappedPageHandlers = {
+    "unmapped", false, false, readUnmapped8, readUnmapped16, readUnmapped32, writeIgnored, writeIgnored, writeIgnored
+};
+
+const MEMORY_PAGE_HANDLERS g_instrumentedPageHandlers = {
+    "instrumented", true, true, instrumentedRead8, instrumentedRead16, instrumentedRead32, instrumentedWrite8, instrumentedWrite16, instrumentedWrite32
+};
+
+const MEMORY_PAGE_HANDLERS g_journaledPageHandlers = {
+    "journaled", true, true, journaledRead8, journaledRead16, journaledRead32, journaledWrite8, journaledWrite16, journaledWrite32
+};
+
+
 extern "C"
 {
+    // Accesses that cross a page boundary are split up into smaller accesses because the two pages might be handled
+    // differently. This can only happen for odd addresses (words) or addresses that are not long word aligned.
     unsigned int m68k_read_8(unsigned int address)
     {
-        LOG4CXX_TRACE(g_logger, Poco::format("8 bit read from address 0x%08x", address));
-        if ((address >= ADDR_MEM_START) && (address <= ADDR_MEM_END))
-            return READ_BYTE(g_mem, address);
+        const MEMORY_PAGE_ENTRY *page = &g_pagetab[MEM_PAGE_INDEX(address)];
+        if (page->mpe_rmem)
+            return READ_BYTE(page->mpe_rmem, address);
         else
-            return 0x55;
+            return page->mpe_handlers->mph_read8(address);
     }
 
     unsigned int m68k_read_16(unsigned int address)
     {
-        LOG4CXX_TRACE(g_logger, Poco::format("16 bit read from address 0x%08x", address));
-        if ((address >= ADDR_MEM_START) && (address <= ADDR_MEM_END - 1))
-            return READ_WORD(g_mem, address);
+        const MEMORY_PAGE_ENTRY *page = &g_pagetab[MEM_PAGE_INDEX(address)];
+        if (!MEM_PAGE_FITS(address, 2))
+            return (m68k_read_8(address) << 8) | m68k_read_8((address + 1) & ADDR_MEM_MASK);
+        else if (page->mpe_rmem)
+            return READ_WORD(page->mpe_rmem, address);
         else
-            return 0xdead;
+            return page->mpe_handlers->mph_read16(address);
     }
 
     unsigned int m68k_read_32(unsigned int address)
     {
-        LOG4CXX_TRACE(g_logger, Poco::format("32 bit read from address 0x%08x", address));
-        if ((address >= ADDR_MEM_START) && (address <= ADDR_MEM_END - 3))
+        const MEMORY_PAGE_ENTRY *page = &g_pagetab[MEM_PAGE_INDEX(address)];
+        if (!MEM_PAGE_FITS(address, 4))
+            return (m68k_read_16(address) << 16) | m68k_read_16((address + 2) & ADDR_MEM_MASK);
+        else if (page->mpe_rmem)
+            return READ_LONG(page->mpe_rmem, address);
+        else
+            return page->mpe_handlers->mph_read32(address);
+    }
+
+
+    // Instructions, their operands and PC-relative data are read directly from memory if they are inside the program
+    // (the subtraction wraps around for addresses below the start, so one comparison is enough). Everything else,
+    // for example the jump tables of the libraries, goes through the normal memory access.
+    unsigned int m68k_read_immediate_16(unsigned int address)
+    {
+        if ((address - s_codeStart) < s_codeSize)
+            return READ_WORD(g_mem, address);
+        else
+            return m68k_read_16(address);
+    }
+
+    unsigned int m68k_read_immediate_32(unsigned int address)
+    {
+        if ((address - s_codeStart) < s_codeSize)
             return READ_LONG(g_mem, address);
         else
-            return 0xdeadbeef;
+            return m68k_read_32(address);
+    }
+
+    unsigned int m68k_read_pcrelative_8(unsigned int address)
+    {
+        if ((address - s_codeStart) < s_codeSize)
+            return READ_BYTE(g_mem, address);
+        else
+            return m68k_read_8(address);
+    }
+
+    unsigned int m68k_read_pcrelative_16(unsigned int address)
+    {
+        if ((address - s_codeStart) < s_codeSize)
+            return READ_WORD(g_mem, address);
+        else
+            return m68k_read_16(address);
+    }
+
+    unsigned int m68k_read_pcrelative_32(unsigned int address)
+    {
+        if ((address - s_codeStart) < s_codeSize)
+            return READ_LONG(g_mem, address);
+        else
+            return m68k_read_32(address);
     }
 
 
@@ -133,31 +1189,39 @@ extern "C"
 
     void m68k_write_8(unsigned int address, unsigned int value)
     {
-        LOG4CXX_TRACE(g_logger, Poco::format("8 bit write to address 0x%08x, value = 0x%02x", address, value));
-        if ((address >= ADDR_MEM_START) && (address <= ADDR_MEM_END))
-            WRITE_BYTE(g_mem, address, value);
+        const MEMORY_PAGE_ENTRY *page = &g_pagetab[MEM_PAGE_INDEX(address)];
+        if (page->mpe_wmem)
+            WRITE_BYTE(page->mpe_wmem, address, value);
         else
-        LOG4CXX_TRACE(g_logger, Poco::format("illegal write access to address 0x%08x", address));
+            page->mpe_handlers->mph_write8(address, value);
     }
 
     void m68k_write_16(unsigned int address, unsigned int value)
     {
-        LOG4CXX_TRACE(g_logger, Poco::format("16 bit write to address 0x%08x, value = 0x%04x", address, value));
-        if ((address >= ADDR_MEM_START) && (address <= ADDR_MEM_END - 1)) {
-            WRITE_WORD(g_mem, address, value);
+        const MEMORY_PAGE_ENTRY *page = &g_pagetab[MEM_PAGE_INDEX(address)];
+        if (!MEM_PAGE_FITS(address, 2)) {
+            m68k_write_8(address, value >> 8);
+            m68k_write_8((address + 1) & ADDR_MEM_MASK, value);
+        }
+        else if (page->mpe_wmem) {
+            WRITE_WORD(page->mpe_wmem, address, value);
         }
         else
-        LOG4CXX_TRACE(g_logger, Poco::format("illegal write access to address 0x%08x", address));
+            page->mpe_handlers->mph_write16(address, value);
     }
 
     void m68k_write_32(unsigned int address, unsigned int value)
     {
-        LOG4CXX_TRACE(g_logger, Poco::format("32 bit write to address 0x%08x, value = 0x%08x", address, value));
-        if ((address >= ADDR_MEM_START) && (address <= ADDR_MEM_END - 3)) {
-            WRITE_LONG(g_mem, address, value);
+        const MEMORY_PAGE_ENTRY *page = &g_pagetab[MEM_PAGE_INDEX(address)];
+        if (!MEM_PAGE_FITS(address, 4)) {
+            m68k_write_16(address, value >> 16);
+            m68k_write_16((address + 2) & ADDR_MEM_MASK, value);
+        }
+        else if (page->mpe_wmem) {
+            WRITE_LONG(page->mpe_wmem, address, value);
         }
         else
-        LOG4CXX_TRACE(g_logger, Poco::format("illegal write access to address 0x%08x", address));
+            page->mpe_handlers->mph_write32(address, value);
     }
 };
 
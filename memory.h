@@ -6,7 +6,11 @@
 
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 #include <string>
+#include <map>
+#include <vector>
 #include <log4cxx/logger.h>
 #include <Poco/Format.h>
 
@@ -31,10 +35,82 @@ extern "C"
 #define ADDR_CODE_END    0x00ffffff     // 8MB code
 #define ADDR_INITIAL_SSP 0x00000000     // address that contains the initial value for the SSP upon reset of the CPU
 #define ADDR_INITIAL_PC  0x00000004     // address that contains the initial value for the PC upon reset of the CPU
-#define ADDR_EXV_TRAP_0   0x00000080    // exception vector for trap #0 (used for the library calls)
+#define ADDR_MEM_MASK    0x00ffffff     // mask for the 24 address bits
+
+
+// page table (the address space is divided into pages of 4KB, each page is either accessed directly or through handlers)
+#define MEM_PAGE_SHIFT       12
+#define MEM_PAGE_SIZE        (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_OFFSET_MASK (MEM_PAGE_SIZE - 1)
+#define MEM_NUM_PAGES        ((ADDR_MEM_END - ADDR_MEM_START + 1) >> MEM_PAGE_SHIFT)
+#define MEM_PAGE_INDEX(ADDR) (((ADDR) >> MEM_PAGE_SHIFT) & (MEM_NUM_PAGES - 1))
+#define MEM_PAGE_FITS(ADDR, NBYTES) (((ADDR) & MEM_PAGE_OFFSET_MASK) <= (MEM_PAGE_SIZE - (NBYTES)))
+
+// size of the inaccessible guard areas around the memory of the VM (2MB, so the memory is aligned for huge pages)
+#define MEM_GUARD_SIZE       0x00200000
 
 
 // macros for reading / writing data
+#ifdef VADM_SWAPPED_MEMORY
+// In this storage layout the memory holds 16-bit words in host byte order (like in other 68k emulators), so aligned
+// word and long word accesses are native loads / stores (long words need their two halves swapped). A byte is
+// stored at its address with bit 0 flipped. Words at odd addresses are put together from single bytes.
+#if !defined(__BYTE_ORDER__) || (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+#error "the swapped storage layout requires a little-endian host"
+#endif
+
+#define GUEST_BYTE_ADDR(ADDR) ((ADDR) ^ 1)
+
+inline uint32_t readSwappedWord(const uint8_t *base, const uint32_t addr)
+{
+    uint16_t val;
+    if (addr & 1)
+        return (base[addr ^ 1] << 8) | base[(addr + 1) ^ 1];
+    memcpy(&val, base + addr, 2);
+    return val;
+}
+
+inline uint32_t readSwappedLong(const uint8_t *base, const uint32_t addr)
+{
+    uint32_t val;
+    if (addr & 1)
+        return (readSwappedWord(base, addr) << 16) | readSwappedWord(base, addr + 2);
+    memcpy(&val, base + addr, 4);
+    return (val << 16) | (val >> 16);
+}
+
+inline void writeSwappedWord(uint8_t *base, const uint32_t addr, const uint32_t value)
+{
+    uint16_t val = value;
+    if (addr & 1) {
+        base[addr ^ 1]       = (value >> 8) & 0xff;
+        base[(addr + 1) ^ 1] = value & 0xff;
+    }
+    else
+        memcpy(base + addr, &val, 2);
+}
+
+inline void writeSwappedLong(uint8_t *base, const uint32_t addr, const uint32_t value)
+{
+    uint32_t val = (value << 16) | (value >> 16);
+    if (addr & 1) {
+        writeSwappedWord(base, addr, value >> 16);
+        writeSwappedWord(base, addr + 2, value);
+    }
+    else
+        memcpy(base + addr, &val, 4);
+}
+
+#define READ_BYTE(BASE, ADDR) (BASE)[(ADDR) ^ 1]
+#define READ_WORD(BASE, ADDR) readSwappedWord(BASE, ADDR)
+#define READ_LONG(BASE, ADDR) readSwappedLong(BASE, ADDR)
+
+#define WRITE_BYTE(BASE, ADDR, VAL) (BASE)[(ADDR) ^ 1] = (VAL)&0xff
+#define WRITE_WORD(BASE, ADDR, VAL) writeSwappedWord(BASE, ADDR, VAL)
+#define WRITE_LONG(BASE, ADDR, VAL) writeSwappedLong(BASE, ADDR, VAL)
+#else
+#define GUEST_BYTE_ADDR(ADDR) (ADDR)
+
 #define READ_BYTE(BASE, ADDR) (BASE)[ADDR]
 #define READ_WORD(BASE, ADDR) (((BASE)[ADDR]<<8) | (BASE)[(ADDR)+1])
 #define READ_LONG(BASE, ADDR) (((BASE)[ADDR]<<24) | ((BASE)[(ADDR)+1]<<16) | ((BASE)[(ADDR)+2]<<8) | (BASE)[(ADDR)+3])
@@ -42,6 +118,11 @@ extern "C"
 #define WRITE_BYTE(BASE, ADDR, VAL) (BASE)[ADDR] = (VAL)&0xff
 #define WRITE_WORD(BASE, ADDR, VAL) (BASE)[ADDR] = ((VAL)>>8) & 0xff; (BASE)[(ADDR)+1] = (VAL)&0xff
 #define WRITE_LONG(BASE, ADDR, VAL) (BASE)[ADDR] = ((VAL)>>24) & 0xff; (BASE)[(ADDR)+1] = ((VAL)>>16)&0xff; (BASE)[(ADDR)+2] = ((VAL)>>8)&0xff;	 (BASE)[(ADDR)+3] = (VAL)&0xff
+#endif
+
+// macros for accessing long word fields of Amiga OS structures in guest memory (independent of the storage layout)
+#define READ_LONG_FIELD(ADDR, TYPE, FIELD) READ_LONG(g_mem, (ADDR) + offsetof(TYPE, FIELD))
+#define WRITE_LONG_FIELD(ADDR, TYPE, FIELD, VAL) WRITE_LONG(g_mem, (ADDR) + offsetof(TYPE, FIELD), VAL)
 
 #define PTR_M68K_TO_HOST(ptr) (g_mem + (uint32_t) ptr)
 #define PTR_HOST_TO_M68K(ptr) ((uint32_t) ((uint8_t *) ptr - g_mem))
@@ -49,39 +130,215 @@ extern "C"
 #define PTR_BCPL_TO_C(ptr) (((uint32_t) (ptr)) << 2)
 
 
+// handlers for pages that need special treatment (library jump tables, code, unmapped areas, I/O)
+typedef struct
+{
+    const char   *mph_name;
+    bool         mph_readable;          // false if reading from these pages is an illegal access
+    bool         mph_writable;          // false if writing to these pages is an illegal access
+    unsigned int (*mph_read8)(unsigned int address);
+    unsigned int (*mph_read16)(unsigned int address);
+    unsigned int (*mph_read32)(unsigned int address);
+    void         (*mph_write8)(unsigned int address, unsigned int value);
+    void         (*mph_write16)(unsigned int address, unsigned int value);
+    void         (*mph_write32)(unsigned int address, unsigned int value);
+} MEMORY_PAGE_HANDLERS;
+
+// entry of the page table
+// If mpe_rmem / mpe_wmem is set, reads / writes go directly to this memory (which is indexed with the full
+// address, so for our RAM it's just g_mem), otherwise the handlers are called.
+typedef struct
+{
+    uint8_t                    *mpe_rmem;
+    uint8_t                    *mpe_wmem;
+    const MEMORY_PAGE_HANDLERS *mpe_handlers;
+} MEMORY_PAGE_ENTRY;
+
+// counters for the instrumented memory handlers
+typedef struct
+{
+    uint64_t mas_reads[3];              // 8, 16 and 32 bit reads
+    uint64_t mas_writes[3];             // 8, 16 and 32 bit writes
+    uint64_t mas_illegalReads;
+    uint64_t mas_illegalWrites;
+} MEMORY_ACCESS_STATS;
+
+// statistics of the heap
+typedef struct
+{
+    uint64_t mhs_allocs;
+    uint64_t mhs_frees;
+    uint64_t mhs_failures;              // allocations that failed because there was no block large enough
+    uint64_t mhs_invalidFrees;          // frees of addresses that are not allocated blocks (ignored)
+    uint32_t mhs_bytesInUse;            // sizes of the blocks in use (including the rounding)
+    uint32_t mhs_peakBytesInUse;
+} MEMORY_HEAP_STATS;
+
+// allocators for the heap (the backend of MemoryManager::alloc() / free())
+enum HeapAllocator
+{
+    HEAP_BINS,                          // segregated free lists
+    HEAP_TLSF                           // Two-Level Segregated Fit (see tlsf.h)
+};
+
+
 // global logger
 extern log4cxx::LoggerPtr g_logger;
 
 // global pointer to memory
 extern uint8_t *g_mem;
 
+// global page table
+extern MEMORY_PAGE_ENTRY g_pagetab[MEM_NUM_PAGES];
+
+// handlers for the different types of pages
+extern const MEMORY_PAGE_HANDLERS g_ramPageHandlers;
+extern const MEMORY_PAGE_HANDLERS g_romPageHandlers;
+extern const MEMORY_PAGE_HANDLERS g_codePageHandlers;
+extern const MEMORY_PAGE_HANDLERS g_unmappedPageHandlers;
+extern const MEMORY_PAGE_HANDLERS g_instrumentedPageHandlers;
+extern const MEMORY_PAGE_HANDLERS g_journaledPageHandlers;
+
+
+// The metadata of the heap is kept outside of the memory of the VM, so the memory of the VM only contains what the
+// program has allocated and the program can't corrupt the allocator by writing past its blocks. The heap is divided
+// into granules of HEAP_GRANULE_SIZE bytes, blocks always start at a granule and the metadata of a block is the
+// entry in a table indexed by the granule where the block starts (entries for other granules are unused).
+#define HEAP_GRANULE_SHIFT   4
+#define HEAP_GRANULE_SIZE    (1 << HEAP_GRANULE_SHIFT)
+#define HEAP_NUM_GRANULES    ((ADDR_HEAP_END - ADDR_HEAP_START + 1) >> HEAP_GRANULE_SHIFT)
+#define HEAP_NONE            0xffffffff     // no block
+#define HEAP_GRANULE_ADDR(G) (ADDR_HEAP_START + ((G) << HEAP_GRANULE_SHIFT))
+
+// states of the entries in the table
+#define HEAP_BLOCK_UNUSED    0              // not the start of a block
+#define HEAP_BLOCK_FREE      1
+#define HEAP_BLOCK_USED      2
+
+typedef struct
+{
+    uint32_t hb_size;                   // size in bytes (multiple of HEAP_GRANULE_SIZE) | HEAP_BLOCK_xxx
+    uint32_t hb_prevPhys;               // granule of the block in front of this one
+    uint32_t hb_nextFree;               // links of a free block in its list
+    uint32_t hb_prevFree;
+} HEAP_BLOCK;
+
+#define HEAP_BLOCK_SIZE(B)   ((B).hb_size & ~(HEAP_GRANULE_SIZE - 1))
+
+// table of n entries (all HEAP_BLOCK_UNUSED), its pages are only backed by memory when they are used first
+HEAP_BLOCK *allocHeapBlocks(const uint32_t n);
+void freeHeapBlocks(HEAP_BLOCK *blocks, const uint32_t n);
+#define HEAP_BLOCK_STATE(B)  ((B).hb_size & (HEAP_GRANULE_SIZE - 1))
+
+// granule of the block at ptr, returns HEAP_NONE if ptr can't be the start of a block
+inline uint32_t heapGranule(const uint8_t *ptr)
+{
+    const uint32_t addr = PTR_HOST_TO_M68K(ptr);
+    if ((addr < ADDR_HEAP_START) || (addr > ADDR_HEAP_END) || (addr & (HEAP_GRANULE_SIZE - 1)))
+        return HEAP_NONE;
+    return (addr - ADDR_HEAP_START) >> HEAP_GRANULE_SHIFT;
+}
+
+
+// functions for copying data between host and guest memory and bulk operations on guest memory (these take care of
+// the storage layout and throw an exception if the area is not inside the memory of the VM)
+void checkGuestRange(const uint32_t addr, const uint32_t len);
+void copyToGuest(const uint32_t dst, const void *src, const uint32_t len);
+void copyFromGuest(void *dst, const uint32_t src, const uint32_t len);
+void moveInGuest(const uint32_t dst, const uint32_t src, const uint32_t len);
+void fillGuest(const uint32_t addr, const uint8_t value, const uint32_t len);
+int compareGuest(const uint32_t addr1, const uint32_t addr2, const uint32_t len);
+bool findInGuest(const uint32_t addr, const uint8_t value, const uint32_t len, uint32_t &pos);
+uint32_t guestStrnlen(const uint32_t addr, uint32_t max);
+uint32_t guestStrlen(const uint32_t addr);
+std::string readGuestString(const uint32_t addr);
+void writeGuestString(const uint32_t addr, const char *str, const uint32_t bufsize);
+
+// Bulk operations requested by the program itself. The functions above bypass the handlers of the pages (so the
+// loader and the libraries can write to read-only pages), these go through them if the memory is not plain RAM.
+void moveInGuestChecked(const uint32_t dst, const uint32_t src, const uint32_t len);
+void fillGuestChecked(const uint32_t addr, const uint8_t value, const uint32_t len);
+
+
+class TlsfHeap;
 
 class MemoryManager
 {
 public:
-    MemoryManager();
+    MemoryManager(const bool hugePages = false, const HeapAllocator allocator = HEAP_BINS);
     ~MemoryManager();
 
     uint8_t * alloc(const uint32_t size);
     void free(uint8_t *block);
+    void reportHeapStats();
+
+    void mapPages(const uint32_t start, const uint32_t end, const MEMORY_PAGE_HANDLERS *handlers, const bool rdirect, const bool wdirect);
+    void enableInstrumentation();
+    void enableJournal();
+    void reportAccessStats();
+    void setCodeArea(const uint32_t start, const uint32_t size);
 
 private:
-    static const uint32_t MEMORY_MIN_BLOCK_SIZE = 256;
-
-    typedef struct
-    {
-        bool     mcb_isFree;
-        uint32_t mcb_size;
-    } MEMORY_CONTROLL_BLOCK;
-    uint8_t *m_lastMemAddr;
+    static const uint32_t MEMORY_NUM_BINS = 18;    // bin i holds the free blocks of HEAP_GRANULE_SIZE << i up to twice that size
+
+    static uint32_t binIndex(const uint32_t size);
+    void insertFree(const uint32_t block);
+    void removeFree(const uint32_t block);
+    uint32_t nextBlock(const uint32_t block) const;
+    uint8_t *useBlock(const uint32_t block, const uint32_t size);
+    uint8_t *allocFromBins(uint32_t size);
+    uint32_t freeToBins(const uint8_t *ptr);
+
+    HEAP_BLOCK *m_blocks;                           // metadata of the heap, only used with HEAP_BINS
+    uint32_t m_top;                                 // granule behind the last block
+    uint32_t m_lastBlock;                           // last block (in front of m_top) or HEAP_NONE
+    uint32_t m_bins[MEMORY_NUM_BINS];              // first free block of each bin or HEAP_NONE
+    uint32_t m_binMask;                             // bit i is set if bin i is not empty
+    TlsfHeap *m_tlsf;                               // only used with HEAP_TLSF
+    MEMORY_HEAP_STATS m_heapStats;
 };
 
 
+
+//
+// Pool of objects of one type in guest memory. The objects are taken from slabs of SLAB_NUM_OBJECTS objects that are
+// allocated on the heap, and freed objects are kept on a free list and reused (the one freed last first), so
+// allocating and freeing an object is O(1) and the objects don't pay for the rounding of the heap. Like the heap,
+// the pool keeps its metadata outside of the memory of the VM and ignores frees of addresses that are not objects
+// in use. The slabs are given back to the heap when the pool is destroyed.
+//
+class SlabPool
+{
+public:
+    SlabPool(MemoryManager *memmgr, const std::string &name, const uint32_t objSize);
+    ~SlabPool();
+
+    uint32_t alloc();
+    void free(const uint32_t obj);
+
+private:
+    static const uint32_t SLAB_NUM_OBJECTS = 32;
+
+    MemoryManager                *m_memmgr;
+    std::string                  m_name;
+    uint32_t                     m_objSize;        // rounded up to a multiple of 4 bytes
+    std::vector<uint32_t>        m_free;           // addresses of the free objects
+    std::map<uint32_t, uint32_t> m_slabs;          // address of each slab => bitmap of the objects in use
+    uint64_t                     m_allocs;
+    uint32_t                     m_inUse;
+    uint32_t                     m_peakInUse;
+};
+
 extern "C"
 {
     unsigned int m68k_read_8(unsigned int address);
     unsigned int m68k_read_16(unsigned int address);
     unsigned int m68k_read_32(unsigned int address);
+    unsigned int m68k_read_immediate_16(unsigned int address);
+    unsigned int m68k_read_immediate_32(unsigned int address);
+    unsigned int m68k_read_pcrelative_8(unsigned int address);
+    unsigned int m68k_read_pcrelative_16(unsigned int address);
+    unsigned int m68k_read_pcrelative_32(unsigned int address);
     unsigned int m68k_peek_16(unsigned int address);
     unsigned int m68k_peek_32(unsigned int address);
     void m68k_write_8(unsigned int address, unsigned int value);
@@ -0,0 +1,163 @@
+//
+// VADM - Two-Level Segregated Fit allocator for the heap of the VM
+//
+// Copyright(C) 2017 Constantin Wiemer
+//
+
+
+#include "tlsf.h"
+
+
+//
+// The whole heap starts as one free block.
+//
+TlsfHeap::TlsfHeap()
+{
+    m_blocks = allocHeapBlocks(HEAP_NUM_GRANULES + 1);
+    m_flBitmap = 0;
+    memset(m_slBitmaps, 0, sizeof(m_slBitmaps));
+    for (uint32_t fl = 0; fl < TLSF_FL_COUNT; ++fl) {
+        for (uint32_t sl = 0; sl < TLSF_SL_COUNT; ++sl)
+            m_lists[fl][sl] = HEAP_NONE;
+    }
+
+    m_blocks[0].hb_size     = HEAP_NUM_GRANULES << HEAP_GRANULE_SHIFT;
+    m_blocks[0].hb_prevPhys = HEAP_NONE;
+    m_blocks[HEAP_NUM_GRANULES].hb_size     = HEAP_BLOCK_USED;
+    m_blocks[HEAP_NUM_GRANULES].hb_prevPhys = 0;
+    insertFree(0);
+}
+
+
+TlsfHeap::~TlsfHeap()
+{
+    freeHeapBlocks(m_blocks, HEAP_NUM_GRANULES + 1);
+}
+
+
+// first and second level index of the list for blocks of size bytes
+void TlsfHeap::mapping(const uint32_t size, uint32_t &fl, uint32_t &sl)
+{
+    if (size < TLSF_SMALL_SIZE) {
+        fl = 0;
+        sl = size >> HEAP_GRANULE_SHIFT;
+    }
+    else {
+        const uint32_t bit = 31 - __builtin_clz(size);
+        sl = (size >> (bit - TLSF_SL_SHIFT)) ^ TLSF_SL_COUNT;
+        fl = bit - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+
+void TlsfHeap::insertFree(const uint32_t block)
+{
+    HEAP_BLOCK &hb = m_blocks[block];
+    uint32_t fl, sl;
+    mapping(HEAP_BLOCK_SIZE(hb), fl, sl);
+    hb.hb_nextFree = m_lists[fl][sl];
+    hb.hb_prevFree = HEAP_NONE;
+    if (m_lists[fl][sl] != HEAP_NONE)
+        m_blocks[m_lists[fl][sl]].hb_prevFree = block;
+    m_lists[fl][sl] = block;
+    m_slBitmaps[fl] |= 1 << sl;
+    m_flBitmap      |= 1 << fl;
+    hb.hb_size = HEAP_BLOCK_SIZE(hb) | HEAP_BLOCK_FREE;
+}
+
+
+void TlsfHeap::removeFree(const uint32_t block)
+{
+    HEAP_BLOCK &hb = m_blocks[block];
+    uint32_t fl, sl;
+    mapping(HEAP_BLOCK_SIZE(hb), fl, sl);
+    if (hb.hb_prevFree != HEAP_NONE)
+        m_blocks[hb.hb_prevFree].hb_nextFree = hb.hb_nextFree;
+    else if ((m_lists[fl][sl] = hb.hb_nextFree) == HEAP_NONE) {
+        if ((m_slBitmaps[fl] &= ~(1 << sl)) == 0)
+            m_flBitmap &= ~(1 << fl);
+    }
+    if (hb.hb_nextFree != HEAP_NONE)
+        m_blocks[hb.hb_nextFree].hb_prevFree = hb.hb_prevFree;
+    hb.hb_size = HEAP_BLOCK_SIZE(hb) | HEAP_BLOCK_USED;
+}
+
+
+//
+// returns nullptr if there is no free block large enough
+//
+uint8_t *TlsfHeap::alloc(const uint32_t size)
+{
+    if (size > ADDR_HEAP_END - ADDR_HEAP_START + 1)
+        return nullptr;
+    uint32_t adjusted = (size + HEAP_GRANULE_SIZE - 1) & ~(HEAP_GRANULE_SIZE - 1);
+    if (adjusted == 0)
+        adjusted = HEAP_GRANULE_SIZE;
+
+    // Round the size up to the next list, so every block in that list (and all lists above it) fits.
+    uint32_t search = adjusted, fl, sl;
+    if (search >= TLSF_SMALL_SIZE)
+        search += (1 << (31 - __builtin_clz(search) - TLSF_SL_SHIFT)) - 1;
+    mapping(search, fl, sl);
+    if (fl >= TLSF_FL_COUNT)
+        return nullptr;
+    uint32_t slmap = m_slBitmaps[fl] & (~0u << sl);
+    if (slmap == 0) {
+        const uint32_t flmap = (fl + 1 < TLSF_FL_COUNT) ? (m_flBitmap & (~0u << (fl + 1))) : 0;
+        if (flmap == 0)
+            return nullptr;
+        fl    = __builtin_ctz(flmap);
+        slmap = m_slBitmaps[fl];
+    }
+    const uint32_t block = m_lists[fl][__builtin_ctz(slmap)];
+    removeFree(block);
+
+    // split off the rest
+    const uint32_t bsize = HEAP_BLOCK_SIZE(m_blocks[block]);
+    if (bsize > adjusted) {
+        const uint32_t rest = block + (adjusted >> HEAP_GRANULE_SHIFT);
+        m_blocks[rest].hb_size     = bsize - adjusted;
+        m_blocks[rest].hb_prevPhys = block;
+        m_blocks[block + (bsize >> HEAP_GRANULE_SHIFT)].hb_prevPhys = rest;
+        m_blocks[block].hb_size = adjusted | HEAP_BLOCK_USED;
+        insertFree(rest);
+    }
+    return PTR_M68K_TO_HOST(HEAP_GRANULE_ADDR(block));
+}
+
+
+//
+// returns the size of the block or 0 if ptr is not an allocated block
+//
+uint32_t TlsfHeap::free(const uint8_t *ptr)
+{
+    uint32_t block = heapGranule(ptr);
+    if ((block == HEAP_NONE) || (HEAP_BLOCK_STATE(m_blocks[block]) != HEAP_BLOCK_USED))
+        return 0;
+    const uint32_t size = HEAP_BLOCK_SIZE(m_blocks[block]);
+
+    // merge with the free blocks in front of and behind this one (the sentinel is never free)
+    const uint32_t prev = m_blocks[block].hb_prevPhys;
+    if ((prev != HEAP_NONE) && (HEAP_BLOCK_STATE(m_blocks[prev]) == HEAP_BLOCK_FREE)) {
+        removeFree(prev);
+        m_blocks[prev].hb_size += size;
+        m_blocks[block].hb_size = HEAP_BLOCK_UNUSED;
+        block = prev;
+    }
+    uint32_t next = block + (HEAP_BLOCK_SIZE(m_blocks[block]) >> HEAP_GRANULE_SHIFT);
+    if (HEAP_BLOCK_STATE(m_blocks[next]) == HEAP_BLOCK_FREE) {
+        removeFree(next);
+        m_blocks[block].hb_size += HEAP_BLOCK_SIZE(m_blocks[next]);
+        m_blocks[next].hb_size = HEAP_BLOCK_UNUSED;
+        next = block + (HEAP_BLOCK_SIZE(m_blocks[block]) >> HEAP_GRANULE_SHIFT);
+    }
+    m_blocks[next].hb_prevPhys = block;
+    insertFree(block);
+    return size;
+}
+
+
+uint32_t TlsfHeap::blockSize(const uint8_t *ptr) const
+{
+    return HEAP_BLOCK_SIZE(m_blocks[heapGranule(ptr)]);
+}
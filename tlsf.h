@@ -0,0 +1,54 @@
+//
+// VADM - Two-Level Segregated Fit allocator for the heap of the VM
+//
+// TLSF (M. Masmano et al., "TLSF: a New Dynamic Memory Allocator for Real-Time Systems") keeps the free blocks in
+// lists indexed by two levels: the first level is the power of 2 of the size, the second level divides each power
+// of 2 into TLSF_SL_COUNT ranges of equal width. Two levels of bitmaps say which lists are not empty, so finding a
+// free block that fits takes a few bit operations and no search at all, and a block is merged with its free
+// neighbours when it is freed. Allocating and freeing therefore take constant time, independent of the history of
+// the heap. Like the default allocator, it keeps the metadata of the blocks outside of the memory of the VM (see
+// HEAP_BLOCK in memory.h).
+//
+// Copyright(C) 2017 Constantin Wiemer
+//
+
+
+#ifndef VADM_TLSF_H
+#define VADM_TLSF_H
+
+
+#include <stdint.h>
+#include "memory.h"
+
+
+#define TLSF_SL_SHIFT     4
+#define TLSF_SL_COUNT     (1 << TLSF_SL_SHIFT)                  // number of lists for each power of 2
+#define TLSF_FL_SHIFT     (TLSF_SL_SHIFT + HEAP_GRANULE_SHIFT)
+#define TLSF_SMALL_SIZE   (1 << TLSF_FL_SHIFT)                  // blocks below this size are all in first level 0
+#define TLSF_FL_MAX       22                                    // the heap is smaller than 4MB
+#define TLSF_FL_COUNT     (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+
+
+class TlsfHeap
+{
+public:
+    TlsfHeap();
+    ~TlsfHeap();
+
+    uint8_t *alloc(const uint32_t size);
+    uint32_t free(const uint8_t *ptr);
+    uint32_t blockSize(const uint8_t *ptr) const;
+
+private:
+    static void mapping(const uint32_t size, uint32_t &fl, uint32_t &sl);
+    void insertFree(const uint32_t block);
+    void removeFree(const uint32_t block);
+
+    HEAP_BLOCK *m_blocks;                       // metadata of the heap, followed by a sentinel (a used block of size 0)
+    uint32_t   m_flBitmap;
+    uint32_t   m_slBitmaps[TLSF_FL_COUNT];
+    uint32_t   m_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+};
+
+
+#endif //VADM_TLSF_H
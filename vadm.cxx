@@ -26,6 +26,12 @@
 #include "cpu.h"
 #include "memory.h"
 #include "loader.h"
+#include "intercept.h"
+#include "blockcache.h"
+
+
+// number of cycles executed with one call of m68k_execute()
+#define EXECUTION_SLICE 0x40000000
 
 
 // global logger
@@ -34,11 +40,17 @@ log4cxx::LoggerPtr g_logger;
 // global pointer to memory
 uint8_t *g_mem;
 
+// global page table
+MEMORY_PAGE_ENTRY g_pagetab[MEM_NUM_PAGES];
+
 // global pointer to MemoryManager object
 MemoryManager *g_memmgr;
 
-// global map of opened libraries
-std::map <uint32_t, AmiLibrary *> g_libmap;
+// global table of opened libraries (indexed by slot)
+AmiLibrary *g_libtab[LIB_MAX_SLOTS];
+
+// directory where the plugins are searched
+std::string g_pluginDir = "plugins";
 
 
 //
@@ -77,27 +89,129 @@ std::string hexdump (const uint8_t *buffer, size_t length)
 }
 
 
+static void reportBlockCacheStats()
+{
+    BLOCK_CACHE_STATS stats;
+    m68k_get_block_cache_stats(&stats);
+    LOG4CXX_INFO(g_logger, "block cache: " << stats.bcs_blocksDecoded << " blocks decoded, "
+        << stats.bcs_blocksInvalidated << " invalidated, " << stats.bcs_blocksFlushed << " flushed, "
+        << stats.bcs_blocksExecuted << " executed (" << stats.bcs_blocksChained << " chained), "
+        << stats.bcs_instrsUncached << " instructions executed uncached");
+    LOG4CXX_INFO(g_logger, "block cache: " << stats.bcs_sequencesCombined << " MOVE / TST / Bcc sequences combined, "
+        << stats.bcs_instrsDropped << " redundant instructions dropped, " << stats.bcs_flagsDropped << " dead flag computations dropped");
+    LOG4CXX_INFO(g_logger, "block cache: loop idioms executed as bulk operations: " << stats.bcs_copyIterations
+        << " copy iterations, " << stats.bcs_fillIterations << " fill iterations, " << stats.bcs_scanIterations << " scan iterations");
+    if (stats.bcs_verifyFailures)
+        LOG4CXX_WARN(g_logger, "block cache: " << stats.bcs_verifyFailures << " hot blocks were changed without being invalidated");
+    if (stats.bcs_blocksCrossChecked)
+        LOG4CXX_INFO(g_logger, "block cache: " << stats.bcs_blocksCrossChecked << " executions of hot blocks cross-checked with the interpreter");
+    if (stats.bcs_crossCheckFailures)
+        LOG4CXX_WARN(g_logger, "block cache: " << stats.bcs_crossCheckFailures << " executions of hot blocks had different results than the interpreter"
+            << Poco::format(" (last one in block 0x%06x)", stats.bcs_lastCrossCheckFailure));
+
+    HOT_BLOCK_INFO info[10];
+    int n = m68k_get_hot_blocks(info, 10);
+    for (int i = 0; i < n; ++i)
+        LOG4CXX_INFO(g_logger, Poco::format("hot block 0x%06x - 0x%06x: %u instructions, executed %u times",
+                                            info[i].hbi_start, info[i].hbi_end - 1, info[i].hbi_ninstrs, info[i].hbi_execCount));
+}
+
+
+static void reportOpcodePairs()
+{
+    OPCODE_PAIR_INFO info[30];
+    char first[100], second[100];
+    int n = m68k_get_opcode_pairs(info, 30);
+
+    // The instructions are disassembled from where the pair was seen first, so the operands are only an example.
+    LOG4CXX_INFO(g_logger, "most frequently executed pairs of opcodes:");
+    for (int i = 0; i < n; ++i) {
+        uint32_t len = m68k_disassemble(first, info[i].opi_address, M68K_CPU_TYPE_68000);
+        m68k_disassemble(second, info[i].opi_address + len, M68K_CPU_TYPE_68000);
+        LOG4CXX_INFO(g_logger, Poco::format("%04x %04x %10s: %s / %s", (unsigned int) info[i].opi_first, (unsigned int) info[i].opi_second,
+                                            std::to_string(info[i].opi_count), std::string(first), std::string(second)));
+    }
+}
+
+
 int main(int argc, char *argv[])
 {
     // setup logging
     g_logger = log4cxx::Logger::getLogger("vadm");
     log4cxx::PropertyConfigurator::configure("logging.properties");
 
+    //
+    // parse options (all arguments before the name of the program)
+    //
+    bool instrumented = false;
+    bool hugePages    = false;
+    bool blockCache   = true;
+    bool verifyBlocks = false;
+    bool opcodePairs  = false;
+    bool loopIdioms   = true;
+    HeapAllocator allocator = HEAP_BINS;
+    std::string intercepts;
+    int argidx = 1;
+    while ((argidx < argc) && (argv[argidx][0] == '-')) {
+        if (strcmp(argv[argidx], "--trace-memory") == 0)
+            instrumented = true;
+        else if (strcmp(argv[argidx], "--huge-pages") == 0)
+            hugePages = true;
+        else if (strcmp(argv[argidx], "--no-block-cache") == 0)
+            blockCache = false;
+        else if (strcmp(argv[argidx], "--verify-blocks") == 0)
+            verifyBlocks = true;
+        else if (strcmp(argv[argidx], "--opcode-pairs") == 0)
+            opcodePairs = true;
+        else if (strcmp(argv[argidx], "--no-loop-idioms") == 0)
+            loopIdioms = false;
+        else if (strcmp(argv[argidx], "--heap=bins") == 0)
+            allocator = HEAP_BINS;
+        else if (strcmp(argv[argidx], "--heap=tlsf") == 0)
+            allocator = HEAP_TLSF;
+        else if (strncmp(argv[argidx], "--plugins=", 10) == 0)
+            g_pluginDir = argv[argidx] + 10;
+        else if (strncmp(argv[argidx], "--intercept=", 12) == 0)
+            intercepts = argv[argidx] + 12;
+        else {
+            LOG4CXX_ERROR(g_logger, "unknown option " << argv[argidx]);
+            return 1;
+        }
+        ++argidx;
+    }
+    if (argidx >= argc) {
+        LOG4CXX_ERROR(g_logger, "usage: vadm [--trace-memory] [--huge-pages] [--no-block-cache] [--verify-blocks] [--opcode-pairs] [--no-loop-idioms] [--heap=bins|tlsf] [--plugins=<dir>] [--intercept=<function>,...] <program> [arguments]");
+        return 1;
+    }
+    // from here on argv[0] is the name of the program
+    argc -= argidx;
+    argv += argidx;
+
     // create memory manager
-    g_memmgr = new MemoryManager();
+    try
+    {
+        g_memmgr = new MemoryManager(hugePages, allocator);
+    }
+    catch (std::exception &e)
+    {
+        LOG4CXX_FATAL(g_logger, "exception occurred while creating memory manager: " << e.what());
+        return 1;
+    }
+    if (instrumented)
+        g_memmgr->enableInstrumentation();
+    if (verifyBlocks)
+        g_memmgr->enableJournal();
 
     //
     // load executable
     //
-    if (argc < 2) {
-        LOG4CXX_ERROR(g_logger, "usage: vadm <program> [arguments]");
-        return 1;
-    }
     LOG4CXX_INFO(g_logger, "loading executable...");
     try
     {
         AmiHunkLoader loader;
-        loader.load(argv[1], ADDR_CODE_START);
+        g_memmgr->setCodeArea(ADDR_CODE_START, loader.load(argv[0], ADDR_CODE_START));
+        if (!intercepts.empty() && !setupIntercepts(intercepts, loader.getSymbols()))
+            return 1;
     }
     catch (std::exception &e)
     {
@@ -111,6 +225,11 @@ int main(int argc, char *argv[])
     LOG4CXX_INFO(g_logger, "initializing CPU...");
     m68k_init();
     m68k_set_cpu_type(M68K_CPU_TYPE_68000);
+    setupLibraryCalls();
+    m68k_init_block_cache(ADDR_CODE_START, ADDR_CODE_END);
+    m68k_set_block_cache_verify(verifyBlocks);
+    m68k_set_opcode_pair_stats(opcodePairs);
+    m68k_set_loop_idioms(loopIdioms);
     // We need to initialize two special addresses where the CPU reads the initial values for its SSP and PC from upon reset.
     // On the Amiga this was done by shadowing these addresses to the ROM where the values were stored.
     // The initial SSP is the first address above the stack area because the stack grows from high to low addresses.
@@ -130,17 +249,16 @@ int main(int argc, char *argv[])
     // We need to construct a new argument vector in the memory of the VM though. We support a maximum of 8 arguments
     // and 1024 characters in total => thus the offset of 32 between nargv and the buffer for the copied strings.
     // Memory needed: 1024 characters + 9 * 4 bytes for the pointers (8 arguments + terminating NULL pointer) + 8 NUL bytes
-    if (argc <= 9) {
+    if (argc <= 8) {
         uint32_t nargc   = 0;
         uint32_t nargv   = PTR_HOST_TO_M68K(g_memmgr->alloc(1068));
         uint32_t bufptr  = nargv + 32;
         uint32_t bufsize = 1024;
 
-        ++argv;                         // skip program name
         while (*argv != NULL) {
             uint32_t arglen = strlen(*argv);
             if (arglen < bufsize) {
-                strncpy((char *) (PTR_M68K_TO_HOST(bufptr)), *argv, bufsize);
+                writeGuestString(bufptr, *argv, bufsize);
                 m68k_write_32(nargv, bufptr);
                 bufptr  += arglen + 1;
                 bufsize -= arglen + 1;
@@ -164,10 +282,11 @@ int main(int argc, char *argv[])
 
     // open Exec library
     m68k_write_32(4, ADDR_EXEC_BASE);                                            // base of Exec library
-    g_libmap[ADDR_EXEC_BASE] = new ExecLibrary(ADDR_EXEC_BASE);
+    g_libtab[LIB_BASE_TO_SLOT(ADDR_EXEC_BASE)] = new ExecLibrary(ADDR_EXEC_BASE);
+    g_libtab[LIB_BASE_TO_SLOT(ADDR_EXEC_BASE)]->m_openCount = 1;
 
-    m68k_write_32(ADDR_EXV_TRAP_0, ADDR_CODE_END - 1);                           // exception vector for traps
-    m68k_write_16(ADDR_CODE_END - 1, 0x4e73);                                    // RTE instruction
+    m68k_write_16(ADDR_CODE_END - 3, 0x4e72);                                    // STOP instruction
+    m68k_write_16(ADDR_CODE_END - 1, 0x2700);                                    // its operand (new SR)
 
     // setup stack
     m68k_set_reg(M68K_REG_SP, ADDR_STACK_END - 7);                               // decrement SP
@@ -177,13 +296,34 @@ int main(int argc, char *argv[])
     // run program
     try
     {
-        m68k_execute(INT32_MAX);
+        // The CPU is run in large slices until the program has executed the STOP instruction at its return address.
+        // The cycles only determine when m68k_execute() returns, so they don't need to be exact.
+        do {
+            if (blockCache)
+                m68k_execute_blocks(EXECUTION_SLICE);
+            else
+                m68k_execute(EXECUTION_SLICE);
+        } while (!m68k_is_stopped());
     }
     catch (std::exception &e)
     {
         LOG4CXX_FATAL(g_logger, "exception occurred while executing program: " << e.what());
+        g_memmgr->reportAccessStats();
+        g_memmgr->reportHeapStats();
+        if (blockCache)
+            reportBlockCacheStats();
+        if (opcodePairs)
+            reportOpcodePairs();
+        reportIntercepts();
         return 1;
     }
 
+    g_memmgr->reportAccessStats();
+    g_memmgr->reportHeapStats();
+    if (blockCache)
+        reportBlockCacheStats();
+    if (opcodePairs)
+        reportOpcodePairs();
+    reportIntercepts();
     return 0;
 }
@@ -0,0 +1,87 @@
+/*
+ * VADM - interface for Amiga libraries implemented natively in shared objects (plugins)
+ *
+ * When a program opens a library that is not built into VADM, for example "foo.library", VADM looks for the shared
+ * object foo.library.so (foo.library.dylib on macOS) in the plugin directory (see the option --plugins). It calls
+ * the function vadmPluginInit() exported by the plugin, which returns the description of the library. Each routine
+ * of the library gets its entry in the jump table at its offset. When the routine is called, VADM calls the native
+ * function, which fetches its arguments from the registers with the services of VADM, and puts its result into D0.
+ *
+ * Plugins are written in plain C so they can be built with any compiler. They must be built as 32-bit code like
+ * VADM itself.
+ *
+ * Copyright(C) 2017 Constantin Wiemer
+ */
+
+
+#ifndef VADM_PLUGIN_H
+#define VADM_PLUGIN_H
+
+
+#include <stdint.h>
+
+
+#define VADM_PLUGIN_ABI_VERSION 1
+#define VADM_PLUGIN_INIT_NAME   "vadmPluginInit"
+
+
+/* registers (the same numbers as used by the CPU emulation) */
+enum
+{
+    VADM_REG_D0 = 0, VADM_REG_D1, VADM_REG_D2, VADM_REG_D3, VADM_REG_D4, VADM_REG_D5, VADM_REG_D6, VADM_REG_D7,
+    VADM_REG_A0, VADM_REG_A1, VADM_REG_A2, VADM_REG_A3, VADM_REG_A4, VADM_REG_A5, VADM_REG_A6, VADM_REG_A7
+};
+
+/* levels for vs_log() */
+enum
+{
+    VADM_LOG_DEBUG = 0, VADM_LOG_INFO, VADM_LOG_WARN, VADM_LOG_ERROR
+};
+
+
+/* services of VADM for the plugins (all addresses are addresses in the memory of the VM) */
+typedef struct
+{
+    uint32_t (*vs_getReg)(int reg);
+    void     (*vs_setReg)(int reg, uint32_t value);
+    uint32_t (*vs_read8)(uint32_t address);
+    uint32_t (*vs_read16)(uint32_t address);
+    uint32_t (*vs_read32)(uint32_t address);
+    void     (*vs_write8)(uint32_t address, uint32_t value);
+    void     (*vs_write16)(uint32_t address, uint32_t value);
+    void     (*vs_write32)(uint32_t address, uint32_t value);
+    void     (*vs_copyToGuest)(uint32_t dst, const void *src, uint32_t len);
+    void     (*vs_copyFromGuest)(void *dst, uint32_t src, uint32_t len);
+    uint32_t (*vs_alloc)(uint32_t size);            /* returns 0 if there is not enough memory */
+    void     (*vs_free)(uint32_t address);
+    void     (*vs_log)(int level, const char *msg);
+} VADM_SERVICES;
+
+
+/* routine of a library, the result is put into D0 */
+typedef struct
+{
+    const char *pf_name;
+    uint16_t   pf_offset;                           /* offset as in the .fd file (bias), a multiple of 6 >= 30 */
+    uint32_t   (*pf_func)(void);
+} VADM_PLUGIN_FUNCTION;
+
+
+/* description of the library */
+typedef struct
+{
+    uint32_t                   pl_abiVersion;       /* VADM_PLUGIN_ABI_VERSION */
+    const char                 *pl_name;            /* for example "foo.library" */
+    uint16_t                   pl_version;
+    uint32_t                   pl_numFuncs;
+    const VADM_PLUGIN_FUNCTION *pl_funcs;
+    int                        (*pl_open)(void);    /* called when the library is opened the first time (optional), 0 = failure */
+    void                       (*pl_close)(void);   /* called when the library is closed the last time (optional) */
+} VADM_PLUGIN;
+
+
+/* function exported by the plugin (the services stay valid as long as the plugin is loaded) */
+typedef const VADM_PLUGIN *(*VADM_PLUGIN_INIT)(const VADM_SERVICES *services);
+
+
+#endif /* VADM_PLUGIN_H */